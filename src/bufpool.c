@@ -0,0 +1,146 @@
+/* Copyright 2013-2024 Bernhard R. Fischer, 4096R/8E24F29D <bf@abenteuerland.at>
+ *
+ * This file is part of Utdns.
+ *
+ * Utdns is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * Utdns is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Utdns. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*! \file bufpool.c
+ *  \author Bernhard R. Fischer, <bf@abenteuerland.at>
+ *
+ *  This file contains a pool of message buffers. Most DNS messages are much
+ *  smaller than the maximum frame size, thus buffers are handed out in a few
+ *  size classes. Released buffers are kept on a free stack per class and are
+ *  reused in O(1). A pool belongs to a single worker, it is not locked.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "utdns.h"
+
+
+//! sizes of the buffer classes, the largest one keeps a complete DNS/TCP frame
+static const int pool_size_[POOL_CLASSES] = {512, 4096, FRAMESIZE + 2};
+
+
+/*! Return the size class of a buffer size.
+ *  @param size Buffer size.
+ *  @return Returns the index of the smallest class which can keep size bytes
+ *  or -1 if size is too large.
+ */
+static int pool_class(int size)
+{
+   int i;
+
+   for (i = 0; i < POOL_CLASSES; i++)
+      if (size <= pool_size_[i])
+         return i;
+   return -1;
+}
+
+
+/*! Initialize an empty buffer pool.
+ *  @param pool Pointer to the pool.
+ */
+void pool_init(buf_pool_t *pool)
+{
+   memset(pool, 0, sizeof(*pool));
+}
+
+
+/*! Free all unused buffers of a pool. Buffers which are still in use have to
+ *  be returned before.
+ *  @param pool Pointer to the pool.
+ */
+void pool_free(buf_pool_t *pool)
+{
+   void *buf;
+   int i;
+
+   for (i = 0; i < POOL_CLASSES; i++)
+      while ((buf = pool->free[i]) != NULL)
+      {
+         pool->free[i] = *((void**) buf);
+         free(buf);
+      }
+   pool_init(pool);
+}
+
+
+/*! Get a buffer from the pool.
+ *  @param pool Pointer to the pool.
+ *  @param size Minimum size of the buffer.
+ *  @param cap Pointer to an integer which receives the actual size of the
+ *  buffer. It has to be passed to pool_put() later.
+ *  @return Returns a pointer to the buffer or NULL in case of error.
+ */
+char *pool_get(buf_pool_t *pool, int size, int *cap)
+{
+   void *buf;
+   int c;
+
+   if ((c = pool_class(size)) == -1)
+   {
+      log_msg(LOG_ERR, "no buffer class for %d bytes", size);
+      return NULL;
+   }
+
+   if ((buf = pool->free[c]) != NULL)
+   {
+      pool->free[c] = *((void**) buf);
+      pool->free_cnt[c]--;
+   }
+   else if ((buf = malloc(pool_size_[c])) == NULL)
+   {
+      log_msg(LOG_ERR, "could not allocate buffer: %s", strerror(errno));
+      return NULL;
+   }
+
+   pool->used_cnt[c]++;
+   *cap = pool_size_[c];
+   return buf;
+}
+
+
+/*! Return a buffer to the pool. At most POOL_MAX_FREE bytes of unused
+ *  buffers are kept per class, the remaining ones are freed.
+ *  @param pool Pointer to the pool.
+ *  @param buf Pointer to the buffer, may be NULL.
+ *  @param cap Size of the buffer as returned by pool_get().
+ */
+void pool_put(buf_pool_t *pool, char *buf, int cap)
+{
+   int c;
+
+   if (buf == NULL)
+      return;
+
+   c = pool_class(cap);
+   pool->used_cnt[c]--;
+   if (pool->free_cnt[c] >= POOL_MAX_FREE / pool_size_[c])
+   {
+      free(buf);
+      return;
+   }
+
+   *((void**) buf) = pool->free[c];
+   pool->free[c] = buf;
+   pool->free_cnt[c]++;
+}
+
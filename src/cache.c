@@ -0,0 +1,454 @@
+/* Copyright 2013-2024 Bernhard R. Fischer, 4096R/8E24F29D <bf@abenteuerland.at>
+ *
+ * This file is part of Utdns.
+ *
+ * Utdns is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * Utdns is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Utdns. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*! \file cache.c
+ *  \author Bernhard R. Fischer, <bf@abenteuerland.at>
+ *
+ *  This file contains the response cache. Answers of the NS are stored keyed
+ *  on the question (qname, qtype, qclass) and some flags of the query. They
+ *  are kept as long as the minimum TTL of all RRs of the answer. When an
+ *  answer is taken from the cache the TTLs are decremented by the time it was
+ *  kept in the cache. Negative answers are cached according to RFC 2308. The
+ *  cache has a fixed number of entries and the least recently used entry is
+ *  removed if it is full.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <arpa/inet.h>
+
+#include "utdns.h"
+
+
+#define RR_TYPE_SOA 6
+
+
+struct cache_entry
+{
+   struct cache_entry *hnext;       // next entry in hash chain
+   struct cache_entry *lru_prev, *lru_next;  // LRU list, head is newest
+   uint32_t hash;                   // hash value of key
+   time_t stored;                   // time when the answer was stored
+   time_t expire;                   // time when the entry expires
+   int key_len;                     // length of key
+   int msg_len;                     // length of the DNS message
+   int ttl_cnt;                     // number of TTLs in the message
+   uint16_t *ttl_off;               // offsets of TTLs within msg
+   char *key;                       // key, i.e. lowercase question and flags
+   char *msg;                       // DNS message
+};
+
+
+static uint16_t get16(const char *p)
+{
+   return ((p[0] & 0xff) << 8) | (p[1] & 0xff);
+}
+
+
+static uint32_t get32(const char *p)
+{
+   return ((uint32_t) get16(p) << 16) | get16(p + 2);
+}
+
+
+static void put32(char *p, uint32_t v)
+{
+   p[0] = v >> 24;
+   p[1] = v >> 16;
+   p[2] = v >> 8;
+   p[3] = v;
+}
+
+
+/*! Build the cache key of a message. The key is the question section with
+ *  the name in lowercase followed by the flags. QTYPE and QCLASS are copied
+ *  unchanged, otherwise types such as 65 ('A') would collide with 97 ('a').
+ *  @param msg Pointer to the DNS message.
+ *  @param qlen Length of the question section.
+ *  @param flags Query flags (CACHE_FLAG_xxx).
+ *  @param key Pointer to the destination buffer which must be at least
+ *  CACHE_KEY_SIZE bytes.
+ *  @param hash Pointer to variable which receives the hash value of the key.
+ *  @return Returns the length of the key.
+ */
+static int cache_key(const char *msg, int qlen, int flags, char *key, uint32_t *hash)
+{
+   uint32_t h;
+   int nlen = qlen - 4;
+
+   h = dns_lower_hash(key, msg + DNS_HDR_LEN, nlen);
+   memcpy(key + nlen, msg + DNS_HDR_LEN + nlen, 4);
+   key[qlen] = flags;
+   h = (h ^ get32(key + nlen)) * 16777619U;
+   *hash = (h ^ flags) * 16777619U;
+   return qlen + 1;
+}
+
+
+/*! Calculate the hash value of the question of a query.
+ *  @param msg Pointer to the DNS query.
+ *  @param qlen Length of the question as returned by dns_query_parse().
+ *  @param flags Query flags as returned by cache_qflags().
+ *  @param hash Pointer to variable which receives the hash value.
+ *  @return Returns 0 on success or -1 if the query is not cacheable.
+ */
+int cache_qhash(const char *msg, int qlen, int flags, uint32_t *hash)
+{
+   char key[CACHE_KEY_SIZE];
+
+   if (flags < 0 || qlen >= CACHE_KEY_SIZE)
+      return -1;
+
+   (void) cache_key(msg, qlen, flags, key, hash);
+   return 0;
+}
+
+
+/*! Compare the questions of two DNS messages. The names are compared
+ *  case-insensitively, QTYPE and QCLASS exactly.
+ *  @param a Pointer to the first message.
+ *  @param b Pointer to the second message.
+ *  @param qlen Length of the question section of both messages.
+ *  @return Returns 0 if both are equal, otherwise 1.
+ */
+int cache_qcmp(const char *a, const char *b, int qlen)
+{
+   char c, d;
+   int i, end = DNS_HDR_LEN + qlen - 4;
+
+   for (i = DNS_HDR_LEN; i < end; i++)
+   {
+      c = a[i];
+      d = b[i];
+      if (c >= 'A' && c <= 'Z')
+         c += 'a' - 'A';
+      if (d >= 'A' && d <= 'Z')
+         d += 'a' - 'A';
+      if (c != d)
+         return 1;
+   }
+   return memcmp(a + end, b + end, 4) != 0;
+}
+
+
+/*! Copy an answer to the buffer of a query. The message ID, the RD bit, and
+ *  the question (to keep the case of the name) of the query are retained.
+ *  @param buf Pointer to the query.
+ *  @param qlen Length of the question section of the query which must be
+ *  equal to that of the answer.
+ *  @param size Total size of buf.
+ *  @param msg Pointer to the answer.
+ *  @param len Length of the answer.
+ *  @return Returns the length of the message in buf or -1 if it does not fit.
+ */
+int cache_copy_answer(char *buf, int qlen, int size, const char *msg, int len)
+{
+   char hdr[3];
+
+   if (len > size || len < DNS_HDR_LEN + qlen)
+      return -1;
+
+   memcpy(hdr, buf, sizeof(hdr));
+   memcpy(buf + DNS_HDR_LEN + qlen, msg + DNS_HDR_LEN + qlen, len - DNS_HDR_LEN - qlen);
+   memcpy(buf + 2, msg + 2, DNS_HDR_LEN - 2);
+   buf[0] = hdr[0];
+   buf[1] = hdr[1];
+   buf[2] = (buf[2] & 0xfe) | (hdr[2] & 0x01);
+   return len;
+}
+
+
+/*! Determine the flags of a query which are relevant for the cache key. The
+ *  answer depends on the presence of EDNS0, the DO bit, and the CD bit.
+ *  @param msg Pointer to the DNS query.
+ *  @param q Pointer to the query as parsed by dns_query_parse().
+ *  @return Returns the flags (CACHE_FLAG_xxx) or -1 if the query is not
+ *  cacheable.
+ */
+int cache_qflags(const char *msg, const dns_query_t *q)
+{
+   int flags = 0;
+
+   // only standard queries with exactly one question are cached
+   if ((msg[2] & 0xf8) || q->qdcount != 1 || q->qlen == -1)
+      return -1;
+
+   if (msg[3] & 0x10)
+      flags |= CACHE_FLAG_CD;
+
+   // the DO bit is the MSB of the flags within the TTL of the OPT RR
+   if (q->opt.off != -1)
+   {
+      flags |= CACHE_FLAG_EDNS;
+      if (msg[q->opt.ttl_off + 2] & 0x80)
+         flags |= CACHE_FLAG_DO;
+   }
+
+   return flags;
+}
+
+
+/*! Initialize the cache.
+ *  @param cache Pointer to the cache structure.
+ *  @param size Maximum number of entries. If it is 0 the cache is disabled.
+ *  @return Returns 0 on success or -1 in case of error.
+ */
+int cache_init(dns_cache_t *cache, int size)
+{
+   memset(cache, 0, sizeof(*cache));
+   if (size <= 0)
+      return 0;
+
+   for (cache->mask = 1; cache->mask < (unsigned) size; cache->mask <<= 1);
+   if ((cache->bucket = calloc(cache->mask, sizeof(*cache->bucket))) == NULL)
+   {
+      log_msg(LOG_ERR, "could not allocate cache: %s", strerror(errno));
+      return -1;
+   }
+   cache->mask--;
+   cache->size = size;
+   return 0;
+}
+
+
+/*! Remove an entry from the cache and free it.
+ */
+static void cache_remove(dns_cache_t *cache, cache_entry_t *ce)
+{
+   cache_entry_t **cp;
+
+   for (cp = &cache->bucket[ce->hash & cache->mask]; *cp != NULL; cp = &(*cp)->hnext)
+      if (*cp == ce)
+      {
+         *cp = ce->hnext;
+         break;
+      }
+
+   if (ce->lru_prev != NULL)
+      ce->lru_prev->lru_next = ce->lru_next;
+   else
+      cache->lru_head = ce->lru_next;
+   if (ce->lru_next != NULL)
+      ce->lru_next->lru_prev = ce->lru_prev;
+   else
+      cache->lru_tail = ce->lru_prev;
+
+   cache->cnt--;
+   free(ce);
+}
+
+
+/*! Free all entries of the cache.
+ */
+void cache_free(dns_cache_t *cache)
+{
+   while (cache->lru_head != NULL)
+      cache_remove(cache, cache->lru_head);
+   free(cache->bucket);
+   cache->bucket = NULL;
+   cache->size = 0;
+}
+
+
+/*! Move an entry to the head of the LRU list.
+ */
+static void cache_touch(dns_cache_t *cache, cache_entry_t *ce)
+{
+   if (cache->lru_head == ce)
+      return;
+
+   ce->lru_prev->lru_next = ce->lru_next;
+   if (ce->lru_next != NULL)
+      ce->lru_next->lru_prev = ce->lru_prev;
+   else
+      cache->lru_tail = ce->lru_prev;
+
+   ce->lru_prev = NULL;
+   ce->lru_next = cache->lru_head;
+   cache->lru_head->lru_prev = ce;
+   cache->lru_head = ce;
+}
+
+
+/*! Find an entry in the cache.
+ *  @return Returns a pointer to the entry or NULL if there is none. Expired
+ *  entries are removed.
+ */
+static cache_entry_t *cache_find(dns_cache_t *cache, const char *key, int key_len, uint32_t hash, time_t now)
+{
+   cache_entry_t *ce;
+
+   for (ce = cache->bucket[hash & cache->mask]; ce != NULL; ce = ce->hnext)
+      if (ce->hash == hash && ce->key_len == key_len && !memcmp(ce->key, key, key_len))
+         break;
+
+   if (ce != NULL && ce->expire <= now)
+   {
+      cache_remove(cache, ce);
+      return NULL;
+   }
+   return ce;
+}
+
+
+/*! Look up the answer to a query in the cache. If it is found, the answer is
+ *  written to buf. The message ID, the RD bit, and the question (to keep the
+ *  case of the name) are taken from the query and the TTLs are decremented by
+ *  the time the answer was kept in the cache.
+ *  @param cache Pointer to the cache.
+ *  @param buf Pointer to the query. The answer is written to the same buffer.
+ *  @param qlen Length of the question as returned by dns_query_parse().
+ *  @param size Total size of buf.
+ *  @param flags Query flags as returned by cache_qflags().
+ *  @param now Current time.
+ *  @return Returns the length of the answer or -1 if there is no answer in the
+ *  cache.
+ */
+int cache_lookup(dns_cache_t *cache, char *buf, int qlen, int size, int flags, time_t now)
+{
+   char key[CACHE_KEY_SIZE];
+   cache_entry_t *ce;
+   uint32_t hash;
+   int i, klen, age;
+
+   if (!cache->size || flags < 0 || qlen >= CACHE_KEY_SIZE)
+      return -1;
+
+   klen = cache_key(buf, qlen, flags, key, &hash);
+   // the question of the query and the cached answer have the same length
+   if ((ce = cache_find(cache, key, klen, hash, now)) == NULL || cache_copy_answer(buf, qlen, size, ce->msg, ce->msg_len) == -1)
+   {
+      cache->misses++;
+      return -1;
+   }
+   cache->hits++;
+   cache_touch(cache, ce);
+
+   age = now - ce->stored;
+   for (i = 0; i < ce->ttl_cnt; i++)
+      put32(buf + ce->ttl_off[i], get32(ce->msg + ce->ttl_off[i]) - age);
+
+   return ce->msg_len;
+}
+
+
+/*! Insert an answer into the cache. Only answers without error (NOERROR or
+ *  NXDOMAIN) which are not truncated are cached. The lifetime of the entry is
+ *  the minimum TTL of all RRs. Negative answers are kept as long as the TTL
+ *  and the MINIMUM field of the SOA record (RFC 2308).
+ *  @param cache Pointer to the cache.
+ *  @param msg Pointer to the DNS message.
+ *  @param len Length of the message.
+ *  @param flags Query flags as returned by cache_qflags().
+ *  @param now Current time.
+ *  @return Returns 0 if the answer was cached, otherwise -1.
+ */
+int cache_insert(dns_cache_t *cache, const char *msg, int len, int flags, time_t now)
+{
+   char key[CACHE_KEY_SIZE];
+   uint16_t ttl_off[CACHE_MAX_RR];
+   cache_entry_t *ce;
+   dns_msg_t m;
+   dns_rr_t rr;
+   uint32_t hash, ttl, min_ttl = CACHE_MAX_TTL;
+   int e, qlen = -1, klen, ttl_cnt = 0, negative;
+
+   if (!cache->size || flags < 0 || len > CACHE_MAX_MSG || dns_msg_init(&m, msg, len) == -1)
+      return -1;
+
+   // QR must be set, TC must not be set, RCODE must be NOERROR or NXDOMAIN
+   if (!(msg[2] & 0x80) || (msg[2] & 0x02) || ((msg[3] & 15) != 0 && (msg[3] & 15) != 3))
+      return -1;
+
+   if (m.cnt[DNS_SEC_QD] != 1)
+      return -1;
+
+   negative = (msg[3] & 15) == 3 || !m.cnt[DNS_SEC_AN];
+   while ((e = dns_msg_next(&m, &rr)) == 1)
+   {
+      if (rr.section == DNS_SEC_QD)
+      {
+         qlen = rr.len;
+         continue;
+      }
+
+      // the TTL field of the OPT RR contains flags
+      if (rr.type == RR_TYPE_OPT)
+         continue;
+
+      if (ttl_cnt >= CACHE_MAX_RR)
+         return -1;
+      ttl_off[ttl_cnt++] = rr.ttl_off;
+      if ((ttl = get32(msg + rr.ttl_off)) < min_ttl)
+         min_ttl = ttl;
+      if (negative && rr.type == RR_TYPE_SOA && rr.rdlen >= 20 && (ttl = get32(msg + rr.rdata + rr.rdlen - 4)) < min_ttl)
+         min_ttl = ttl;
+   }
+
+   if (e == -1 || qlen >= CACHE_KEY_SIZE)
+      return -1;
+
+   // negative answers without SOA are not cached
+   if (!ttl_cnt || !min_ttl || min_ttl > CACHE_MAX_TTL)
+      return -1;
+
+   klen = cache_key(msg, qlen, flags, key, &hash);
+   if ((ce = cache_find(cache, key, klen, hash, now)) != NULL)
+      cache_remove(cache, ce);
+
+   if (cache->cnt >= cache->size)
+      cache_remove(cache, cache->lru_tail);
+
+   if ((ce = malloc(sizeof(*ce) + ttl_cnt * sizeof(*ttl_off) + klen + len)) == NULL)
+   {
+      log_msg(LOG_ERR, "could not allocate cache entry: %s", strerror(errno));
+      return -1;
+   }
+
+   ce->hash = hash;
+   ce->stored = now;
+   ce->expire = now + min_ttl;
+   ce->ttl_cnt = ttl_cnt;
+   ce->ttl_off = (uint16_t*) (ce + 1);
+   memcpy(ce->ttl_off, ttl_off, ttl_cnt * sizeof(*ttl_off));
+   ce->key = (char*) (ce->ttl_off + ttl_cnt);
+   ce->key_len = klen;
+   memcpy(ce->key, key, klen);
+   ce->msg = ce->key + klen;
+   ce->msg_len = len;
+   memcpy(ce->msg, msg, len);
+
+   ce->hnext = cache->bucket[hash & cache->mask];
+   cache->bucket[hash & cache->mask] = ce;
+   ce->lru_prev = NULL;
+   ce->lru_next = cache->lru_head;
+   if (cache->lru_head != NULL)
+      cache->lru_head->lru_prev = ce;
+   else
+      cache->lru_tail = ce;
+   cache->lru_head = ce;
+   cache->cnt++;
+   cache->inserts++;
+
+   return 0;
+}
+
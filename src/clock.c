@@ -0,0 +1,117 @@
+/* Copyright 2013-2024 Bernhard R. Fischer, 4096R/8E24F29D <bf@abenteuerland.at>
+ *
+ * This file is part of Utdns.
+ *
+ * Utdns is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * Utdns is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Utdns. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*! \file clock.c
+ *  \author Bernhard R. Fischer, <bf@abenteuerland.at>
+ *
+ *  This file contains a cached clock. The event loop of a thread reads the
+ *  monotonic clock once per iteration with clock_update(). All timeouts,
+ *  latency measurements and log timestamps of that iteration use this
+ *  value. The wall clock time is derived from it by an offset which is
+ *  refreshed at most once per second. Threads which do not call
+ *  clock_update() read the clocks directly.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <time.h>
+#include <sys/time.h>
+
+#include "utdns.h"
+
+
+#ifdef WITH_THREADS
+#define THREAD_LOCAL __thread
+#else
+#define THREAD_LOCAL
+#endif
+
+//! cached monotonic time [ms] of the current thread, 0 if not driven by a loop
+static THREAD_LOCAL uint64_t now_ = 0;
+//! offset [us] of the wall clock to the monotonic clock
+static THREAD_LOCAL int64_t wall_off_ = 0;
+//! monotonic time [ms] when wall_off_ was refreshed
+static THREAD_LOCAL uint64_t wall_upd_ = 0;
+
+
+static uint64_t ts_to_us(const struct timespec *ts)
+{
+   return (uint64_t) ts->tv_sec * 1000000 + ts->tv_nsec / 1000;
+}
+
+
+/*! Read the monotonic clock and update the cached time of the current
+ *  thread.
+ *  @return Returns the monotonic time in milliseconds.
+ */
+uint64_t clock_update(void)
+{
+   struct timespec ts, wall;
+   uint64_t us;
+
+   (void) clock_gettime(CLOCK_MONOTONIC, &ts);
+   us = ts_to_us(&ts);
+   now_ = us / 1000;
+
+   // follow steps of the wall clock
+   if (!wall_upd_ || now_ - wall_upd_ >= 1000)
+   {
+      (void) clock_gettime(CLOCK_REALTIME, &wall);
+      wall_off_ = (int64_t) (ts_to_us(&wall) - us);
+      wall_upd_ = now_;
+   }
+   return now_;
+}
+
+
+/*! Return the cached monotonic time of the current thread. If the thread
+ *  never called clock_update() the clock is read.
+ *  @return Returns the time in milliseconds as of the last call to
+ *  clock_update().
+ */
+uint64_t clock_ms(void)
+{
+   struct timespec ts;
+
+   if (now_)
+      return now_;
+
+   (void) clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts_to_us(&ts) / 1000;
+}
+
+
+/*! Return the wall clock time. Within a thread which calls clock_update()
+ *  regularly this is the cached time, otherwise the clock is read.
+ *  @param tv Pointer to a timeval which receives the time.
+ */
+void clock_wall(struct timeval *tv)
+{
+   uint64_t us;
+
+   if (!now_)
+   {
+      (void) gettimeofday(tv, NULL);
+      return;
+   }
+
+   us = now_ * 1000 + wall_off_;
+   tv->tv_sec = us / 1000000;
+   tv->tv_usec = us % 1000000;
+}
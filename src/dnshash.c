@@ -0,0 +1,310 @@
+/* Copyright 2013-2024 Bernhard R. Fischer, 4096R/8E24F29D <bf@abenteuerland.at>
+ *
+ * This file is part of Utdns.
+ *
+ * Utdns is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * Utdns is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Utdns. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*! \file dnshash.c
+ *  \author Bernhard R. Fischer, <bf@abenteuerland.at>
+ *
+ *  This file contains the canonicalization of domain names. A name in wire
+ *  format is converted to lowercase and hashed in a single pass. The name is
+ *  processed in blocks of 16 bytes, the hash mixes the two 64 bit words of
+ *  every block into two independent lanes. Thus the hash does not depend on
+ *  the implementation: there is a scalar version and versions with SSE2 (16
+ *  bytes per step) and AVX2 (32 bytes per step) on x86_64. The fastest one
+ *  which is supported by the CPU is selected at runtime by dns_hash_init().
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+
+#include "utdns.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define HAVE_X86_SIMD
+#include <immintrin.h>
+#endif
+
+
+#define HASH_SEED0 0x9e3779b97f4a7c15ULL
+#define HASH_SEED1 0xc2b2ae3d27d4eb4fULL
+#define HASH_MUL 0xff51afd7ed558ccdULL
+
+
+typedef uint32_t (*lower_hash_func_t)(char *, const char *, int);
+
+
+static uint64_t rotl64(uint64_t x, int r)
+{
+   return (x << r) | (x >> (64 - r));
+}
+
+
+/*! Mix a block of 16 bytes into the hash state.
+ */
+static void mix_block(uint64_t *h, uint64_t w0, uint64_t w1)
+{
+   h[0] = rotl64((h[0] ^ w0) * HASH_MUL, 31);
+   h[1] = rotl64((h[1] ^ w1) * HASH_MUL, 29);
+}
+
+
+static uint32_t hash_final(const uint64_t *h, int len)
+{
+   uint64_t x;
+
+   x = (h[0] ^ rotl64(h[1], 17) ^ (uint64_t) len) * HASH_MUL;
+   x ^= x >> 33;
+   return (uint32_t) x ^ (uint32_t) (x >> 32);
+}
+
+
+/*! Scalar version of dns_lower_hash(). It is the reference of the SIMD
+ *  versions.
+ */
+static uint32_t lower_hash_scalar(char *dst, const char *src, int len)
+{
+   uint64_t h[2] = {HASH_SEED0, HASH_SEED1}, w[2];
+   char blk[16];
+   int i, j, n;
+   char c;
+
+   for (i = 0; i < len; i += 16)
+   {
+      n = len - i < 16 ? len - i : 16;
+      memset(blk, 0, sizeof(blk));
+      for (j = 0; j < n; j++)
+      {
+         c = src[i + j];
+         if (c >= 'A' && c <= 'Z')
+            c += 'a' - 'A';
+         dst[i + j] = blk[j] = c;
+      }
+      memcpy(w, blk, sizeof(w));
+      mix_block(h, w[0], w[1]);
+   }
+   return hash_final(h, len);
+}
+
+
+#ifdef HAVE_X86_SIMD
+/*! Convert the uppercase letters of 16 bytes to lowercase. Bytes >= 0x80 are
+ *  negative for the signed comparison, thus they are left untouched.
+ */
+static __m128i lower16(__m128i v)
+{
+   __m128i m;
+
+   m = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('A' - 1)), _mm_cmplt_epi8(v, _mm_set1_epi8('Z' + 1)));
+   return _mm_or_si128(v, _mm_and_si128(m, _mm_set1_epi8(0x20)));
+}
+
+
+/*! Process a name in blocks of 16 bytes with SSE2. The last partial block is
+ *  copied to a zero-padded buffer, thus nothing is read or written beyond the
+ *  name.
+ */
+static void lower_blocks_sse2(uint64_t *h, char *dst, const char *src, int len)
+{
+   char blk[16];
+   __m128i v;
+   int i;
+
+   for (i = 0; i + 16 <= len; i += 16)
+   {
+      v = lower16(_mm_loadu_si128((const __m128i*) (src + i)));
+      _mm_storeu_si128((__m128i*) (dst + i), v);
+      mix_block(h, _mm_cvtsi128_si64(v), _mm_cvtsi128_si64(_mm_unpackhi_epi64(v, v)));
+   }
+
+   if (i < len)
+   {
+      memset(blk, 0, sizeof(blk));
+      memcpy(blk, src + i, len - i);
+      v = lower16(_mm_loadu_si128((const __m128i*) blk));
+      _mm_storeu_si128((__m128i*) blk, v);
+      memcpy(dst + i, blk, len - i);
+      mix_block(h, _mm_cvtsi128_si64(v), _mm_cvtsi128_si64(_mm_unpackhi_epi64(v, v)));
+   }
+}
+
+
+static uint32_t lower_hash_sse2(char *dst, const char *src, int len)
+{
+   uint64_t h[2] = {HASH_SEED0, HASH_SEED1};
+
+   lower_blocks_sse2(h, dst, src, len);
+   return hash_final(h, len);
+}
+
+
+/*! AVX2 version of dns_lower_hash(). It processes 32 bytes (2 blocks) per
+ *  step, the remainder is done with SSE2.
+ */
+__attribute__((target("avx2")))
+static uint32_t lower_hash_avx2(char *dst, const char *src, int len)
+{
+   uint64_t h[2] = {HASH_SEED0, HASH_SEED1};
+   __m256i v, m;
+   __m128i lo, hi;
+   int i;
+
+   for (i = 0; i + 32 <= len; i += 32)
+   {
+      v = _mm256_loadu_si256((const __m256i*) (src + i));
+      m = _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8('A' - 1)), _mm256_cmpgt_epi8(_mm256_set1_epi8('Z' + 1), v));
+      v = _mm256_or_si256(v, _mm256_and_si256(m, _mm256_set1_epi8(0x20)));
+      _mm256_storeu_si256((__m256i*) (dst + i), v);
+
+      lo = _mm256_castsi256_si128(v);
+      hi = _mm256_extracti128_si256(v, 1);
+      mix_block(h, _mm_cvtsi128_si64(lo), _mm_extract_epi64(lo, 1));
+      mix_block(h, _mm_cvtsi128_si64(hi), _mm_extract_epi64(hi, 1));
+   }
+
+   lower_blocks_sse2(h, dst + i, src + i, len - i);
+   return hash_final(h, len);
+}
+#endif
+
+
+//! implementation selected by dns_hash_init()
+static lower_hash_func_t lower_hash_ = lower_hash_scalar;
+static const char *lower_hash_name_ = "scalar";
+
+
+/*! Select the fastest implementation of dns_lower_hash() which is supported
+ *  by the CPU. This has to be called before the worker threads are started.
+ *  @return Returns the name of the implementation.
+ */
+const char *dns_hash_init(void)
+{
+#ifdef HAVE_X86_SIMD
+   __builtin_cpu_init();
+   if (__builtin_cpu_supports("avx2"))
+   {
+      lower_hash_ = lower_hash_avx2;
+      lower_hash_name_ = "avx2";
+   }
+   else
+   {
+      // SSE2 is part of x86_64
+      lower_hash_ = lower_hash_sse2;
+      lower_hash_name_ = "sse2";
+   }
+#endif
+   return lower_hash_name_;
+}
+
+
+/*! Convert a domain name in wire format to lowercase and calculate its hash
+ *  value. The label length bytes are never within 'A'..'Z' thus they are not
+ *  changed.
+ *  @param dst Pointer to the destination buffer of at least len bytes.
+ *  @param src Pointer to the name.
+ *  @param len Length of the name.
+ *  @return Returns the hash value.
+ */
+uint32_t dns_lower_hash(char *dst, const char *src, int len)
+{
+   return lower_hash_(dst, src, len);
+}
+
+
+#ifdef TEST_UTDNS_FUNC
+#include <stdlib.h>
+
+#define BENCH_NAMES 4096
+#define BENCH_ROUNDS 2000
+
+/*! Microbenchmark which compares the implementations of dns_lower_hash().
+ *  All of them have to return the same results.
+ */
+void dns_hash_bench(void)
+{
+   static const struct
+   {
+      const char *name;
+      lower_hash_func_t func;
+   } impl[] =
+   {
+      {"scalar", lower_hash_scalar},
+#ifdef HAVE_X86_SIMD
+      {"sse2", lower_hash_sse2},
+      {"avx2", lower_hash_avx2},
+#endif
+   };
+   static char names[BENCH_NAMES][DNS_NAME_SIZE];
+   static int lens[BENCH_NAMES];
+   char dst[DNS_NAME_SIZE], ref[DNS_NAME_SIZE];
+   struct timespec t0, t1;
+   uint32_t h, sum, sum0 = 0;
+   int i, j, k, n, total = 0;
+   double ns, ns0 = 0;
+
+   // names of 2..6 random mixed case labels
+   srandom(1);
+   for (i = 0; i < BENCH_NAMES; i++)
+   {
+      for (n = 0, k = 2 + random() % 5; k > 0; k--)
+      {
+         j = 1 + random() % 15;
+         names[i][n++] = j;
+         for (; j > 0; j--)
+            names[i][n++] = (random() & 1 ? 'A' : 'a') + random() % 26;
+      }
+      names[i][n++] = 0;
+      lens[i] = n;
+      total += n;
+   }
+   printf("%d names, avg length %.1f bytes, selected: %s\n", BENCH_NAMES, (double) total / BENCH_NAMES, dns_hash_init());
+
+   for (k = 0; k < (int) (sizeof(impl) / sizeof(*impl)); k++)
+   {
+#ifdef HAVE_X86_SIMD
+      if (impl[k].func == lower_hash_avx2 && !__builtin_cpu_supports("avx2"))
+         continue;
+#endif
+      // check against the reference
+      for (i = 0; i < BENCH_NAMES; i++)
+      {
+         h = impl[k].func(dst, names[i], lens[i]);
+         if (h != lower_hash_scalar(ref, names[i], lens[i]) || memcmp(dst, ref, lens[i]))
+         {
+            printf("%s: mismatch at name %d\n", impl[k].name, i);
+            exit(EXIT_FAILURE);
+         }
+      }
+
+      clock_gettime(CLOCK_MONOTONIC, &t0);
+      for (sum = 0, j = 0; j < BENCH_ROUNDS; j++)
+         for (i = 0; i < BENCH_NAMES; i++)
+            sum += impl[k].func(dst, names[i], lens[i]);
+      clock_gettime(CLOCK_MONOTONIC, &t1);
+
+      ns = ((t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec)) / ((double) BENCH_ROUNDS * BENCH_NAMES);
+      if (!k)
+      {
+         ns0 = ns;
+         sum0 = sum;
+      }
+      printf("%-8s %6.2f ns/name %6.2f bytes/ns  speedup %.2f%s\n", impl[k].name, ns, total / (ns * BENCH_NAMES),
+            ns0 / ns, sum == sum0 ? "" : "  (checksum differs)");
+   }
+}
+#endif
@@ -0,0 +1,249 @@
+/* Copyright 2013-2024 Bernhard R. Fischer, 4096R/8E24F29D <bf@abenteuerland.at>
+ *
+ * This file is part of Utdns.
+ *
+ * Utdns is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * Utdns is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Utdns. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*! \file dnsmsg.c
+ *  \author Bernhard R. Fischer, <bf@abenteuerland.at>
+ *
+ *  This file contains the parser of DNS messages. Messages are not copied or
+ *  decoded, the parser walks through the sections in place and returns the
+ *  offsets and lengths of the records. Every access is checked against the
+ *  length of the message. Compression pointers are followed only when a name
+ *  is decoded to a string and the number of pointers is limited, thus
+ *  malicious messages cannot cause loops.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+
+#include "utdns.h"
+
+
+// maximum number of compression pointers followed within a name
+#define DNS_MAX_PTR 16
+
+
+static int get16(const char *p)
+{
+   return ((p[0] & 0xff) << 8) | (p[1] & 0xff);
+}
+
+
+/*! Skip a domain name within a DNS message. Compression pointers are not
+ *  followed, a pointer terminates the name.
+ *  @param msg Pointer to the DNS message.
+ *  @param len Length of the message.
+ *  @param off Offset of the name within the message.
+ *  @return Returns the offset of the first byte following the name or -1 if
+ *  the name exceeds the message or is malformed.
+ */
+int dns_name_end(const char *msg, int len, int off)
+{
+   int llen;
+
+   while (off < len)
+   {
+      llen = msg[off] & 0xff;
+      if (!llen)
+         return off + 1;
+      if ((llen & 0xc0) == 0xc0)
+         return off + 2 <= len ? off + 2 : -1;
+      // extended label types are obsolete
+      if (llen & 0xc0)
+         return -1;
+      off += llen + 1;
+   }
+   return -1;
+}
+
+
+/*! Decode a domain name of a DNS message to a \0-terminated string in dotted
+ *  notation. Compression pointers are followed. Non-printable characters are
+ *  replaced by '?'.
+ *  @param msg Pointer to the DNS message.
+ *  @param len Length of the message.
+ *  @param off Offset of the name within the message.
+ *  @param buf Pointer to the destination buffer.
+ *  @param size Size of buf, DNS_NAME_SIZE is sufficient for every valid name.
+ *  @return Returns the length of the string or -1 if the name is malformed,
+ *  contains too many compression pointers, or does not fit into buf.
+ */
+int dns_name_str(const char *msg, int len, int off, char *buf, int size)
+{
+   int i, llen, n = 0, ptr = 0;
+   char c;
+
+   for (;;)
+   {
+      if (off >= len)
+         return -1;
+
+      llen = msg[off] & 0xff;
+      if (!llen)
+         break;
+
+      if ((llen & 0xc0) == 0xc0)
+      {
+         if (off + 2 > len || ++ptr > DNS_MAX_PTR)
+            return -1;
+         off = ((llen & 0x3f) << 8) | (msg[off + 1] & 0xff);
+         continue;
+      }
+
+      if ((llen & 0xc0) || off + 1 + llen > len || n + llen + 1 >= size)
+         return -1;
+
+      for (i = 1; i <= llen; i++)
+      {
+         c = msg[off + i];
+         buf[n++] = c > ' ' && c < 127 ? c : '?';
+      }
+      buf[n++] = '.';
+      off += llen + 1;
+   }
+
+   // root domain
+   if (!n)
+   {
+      if (size < 2)
+         return -1;
+      buf[n++] = '.';
+   }
+   buf[n] = '\0';
+   return n;
+}
+
+
+/*! Initialize an iterator over the records of a DNS message.
+ *  @param m Pointer to the iterator.
+ *  @param msg Pointer to the DNS message.
+ *  @param len Length of the message.
+ *  @return Returns 0 on success or -1 if the message is shorter than the
+ *  header.
+ */
+int dns_msg_init(dns_msg_t *m, const char *msg, int len)
+{
+   int i;
+
+   if (len < DNS_HDR_LEN)
+      return -1;
+
+   m->msg = msg;
+   m->len = len;
+   for (i = 0; i < DNS_SECTIONS; i++)
+      m->cnt[i] = get16(msg + 4 + 2 * i);
+   m->sec = DNS_SEC_QD;
+   m->idx = 0;
+   m->off = DNS_HDR_LEN;
+   return 0;
+}
+
+
+/*! Return the next record of a DNS message. The questions are returned as
+ *  records without TTL and RDATA. The records of all sections are returned in
+ *  the order of the message.
+ *  @param m Pointer to the iterator.
+ *  @param rr Pointer to a structure which receives the offsets of the record.
+ *  @return Returns 1 if a record was returned, 0 if there are no more records,
+ *  or -1 if the message is malformed. The iterator must not be used anymore
+ *  after an error.
+ */
+int dns_msg_next(dns_msg_t *m, dns_rr_t *rr)
+{
+   int off;
+
+   while (m->idx >= m->cnt[m->sec])
+   {
+      if (m->sec == DNS_SEC_AR)
+         return 0;
+      m->sec++;
+      m->idx = 0;
+   }
+
+   if ((off = dns_name_end(m->msg, m->len, m->off)) == -1 || off + 4 > m->len)
+      return -1;
+
+   rr->section = m->sec;
+   rr->off = m->off;
+   rr->type = get16(m->msg + off);
+   rr->class = get16(m->msg + off + 2);
+
+   if (m->sec == DNS_SEC_QD)
+   {
+      rr->ttl_off = -1;
+      rr->rdata = off + 4;
+      rr->rdlen = 0;
+   }
+   else
+   {
+      if (off + 10 > m->len)
+         return -1;
+      rr->ttl_off = off + 4;
+      rr->rdlen = get16(m->msg + off + 8);
+      rr->rdata = off + 10;
+      if (rr->rdata + rr->rdlen > m->len)
+         return -1;
+   }
+
+   rr->len = rr->rdata + rr->rdlen - rr->off;
+   m->off = rr->rdata + rr->rdlen;
+   m->idx++;
+   return 1;
+}
+
+
+/*! Parse a query with a single pass through the message. The results are
+ *  used by the logger, the cache, and the EDNS0 options thus none of them has
+ *  to parse the query again.
+ *  @param msg Pointer to the DNS query.
+ *  @param len Length of the query.
+ *  @param q Pointer to a structure which receives the results.
+ *  @return Returns 0 on success or -1 if the message is malformed.
+ */
+int dns_query_parse(const char *msg, int len, dns_query_t *q)
+{
+   dns_msg_t m;
+   dns_rr_t rr;
+   int e;
+
+   q->qdcount = 0;
+   q->qlen = -1;
+   q->qtype = q->qclass = -1;
+   q->opt.off = -1;
+
+   if (dns_msg_init(&m, msg, len) == -1)
+      return -1;
+   q->qdcount = m.cnt[DNS_SEC_QD];
+
+   while ((e = dns_msg_next(&m, &rr)) == 1)
+   {
+      if (rr.section == DNS_SEC_QD)
+      {
+         if (q->qlen == -1)
+         {
+            q->qlen = rr.len;
+            q->qtype = rr.type;
+            q->qclass = rr.class;
+         }
+      }
+      else if (rr.type == RR_TYPE_OPT && q->opt.off == -1)
+         q->opt = rr;
+   }
+   return e;
+}
@@ -0,0 +1,612 @@
+/* Copyright 2013-2024 Bernhard R. Fischer, 4096R/8E24F29D <bf@abenteuerland.at>
+ *
+ * This file is part of Utdns.
+ *
+ * Utdns is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * Utdns is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Utdns. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*! \file dnstap.c
+ *  \author Bernhard R. Fischer, <bf@abenteuerland.at>
+ *
+ *  This file contains the binary query log in the dnstap format
+ *  (https://dnstap.info). Every worker encodes the dnstap protobuf messages
+ *  directly into the records of its own ring. A writer thread collects the
+ *  frames of all rings and writes them in batches as Frame Streams, either
+ *  to a file (unidirectional) or to a Unix socket (bidirectional with
+ *  handshake). If the ring is full or the output is not available frames are
+ *  dropped and counted, the workers never block. Without threads the frames
+ *  are written immediately.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#ifdef WITH_THREADS
+#include <pthread.h>
+#endif
+
+#include "utdns.h"
+
+
+// number of records of a ring, must be a power of 2
+#define TAP_RING_SIZE 4096
+// maximum number of rings
+#define TAP_MAX_RINGS 64
+// size of a record, larger DNS messages are logged without the message
+#define TAP_REC_SIZE 2048
+// space reserved in front of the Message for the frame and Dnstap headers
+#define TAP_PREFIX 64
+// size of the output buffer of the writer
+#define TAP_WBUF_SIZE 65536
+// time [ms] the writer sleeps if all rings are empty
+#define TAP_IDLE_MS 10
+// time [ms] the writer sleeps after frames were written
+#define TAP_BUSY_MS 1
+// minimum time [ms] between two attempts to connect the socket
+#define TAP_RECONNECT 1000
+
+// Frame Streams control frame types and fields
+#define FSTRM_ACCEPT 1
+#define FSTRM_START 2
+#define FSTRM_STOP 3
+#define FSTRM_READY 4
+#define FSTRM_FINISH 5
+#define FSTRM_CONTENT_TYPE 1
+#define FSTRM_MAX_CONTROL 512
+
+// protobuf wire types
+#define PB_VARINT 0
+#define PB_BYTES 2
+#define PB_FIXED32 5
+
+// fields of the dnstap protobuf schema
+#define DT_VERSION 2
+#define DT_MESSAGE 14
+#define DT_TYPE 15
+#define DT_TYPE_MESSAGE 1
+#define DTM_TYPE 1
+#define DTM_FAMILY 2
+#define DTM_PROTOCOL 3
+#define DTM_QUERY_ADDRESS 4
+#define DTM_RESPONSE_ADDRESS 5
+#define DTM_QUERY_PORT 6
+#define DTM_RESPONSE_PORT 7
+#define DTM_QUERY_TIME_SEC 8
+#define DTM_QUERY_TIME_NSEC 9
+#define DTM_QUERY_MESSAGE 10
+#define DTM_RESPONSE_TIME_SEC 12
+#define DTM_RESPONSE_TIME_NSEC 13
+#define DTM_RESPONSE_MESSAGE 14
+#define DT_FAMILY_INET 1
+#define DT_FAMILY_INET6 2
+#define DT_PROTOCOL_UDP 1
+#define DT_PROTOCOL_TCP 2
+
+
+//! record of a ring, it contains one complete frame
+typedef struct tap_rec
+{
+   int off;                         // offset of the frame within buf
+   int len;                         // length of the frame
+   char buf[TAP_REC_SIZE - 2 * sizeof(int)];
+} tap_rec_t;
+
+
+static const char content_type_[] = "protobuf:dnstap.Dnstap";
+
+//! path of the output, NULL if dnstap is disabled
+static char *path_ = NULL;
+//! set if the output is a Unix socket
+static int sock_ = 0;
+//! file descriptor of the output, -1 if not open
+static int fd_ = -1;
+//! time [ms] of the next attempt to connect the socket
+static uint64_t retry_ = 0;
+//! rings of the workers
+static spsc_t rings_[TAP_MAX_RINGS];
+//! number of frames dropped because the ring was full, per ring
+static unsigned long dropped_[TAP_MAX_RINGS];
+static int ring_cnt_ = 0;
+//! number of frames written and lost, only changed by the writer
+static unsigned long written_ = 0, lost_ = 0;
+//! output buffer of the writer
+static char wbuf_[TAP_WBUF_SIZE];
+static int wlen_ = 0, wcnt_ = 0;
+#ifdef WITH_THREADS
+//! set while the writer thread is running
+static int running_ = 0;
+static pthread_t writer_;
+#endif
+
+
+static void put32(char *p, uint32_t v)
+{
+   p[0] = v >> 24;
+   p[1] = v >> 16;
+   p[2] = v >> 8;
+   p[3] = v;
+}
+
+
+static char *pb_varint(char *p, uint64_t v)
+{
+   for (; v >= 0x80; v >>= 7)
+      *p++ = (v & 0x7f) | 0x80;
+   *p++ = v;
+   return p;
+}
+
+
+static char *pb_uint(char *p, int field, uint64_t v)
+{
+   p = pb_varint(p, (field << 3) | PB_VARINT);
+   return pb_varint(p, v);
+}
+
+
+static char *pb_fixed32(char *p, int field, uint32_t v)
+{
+   p = pb_varint(p, (field << 3) | PB_FIXED32);
+   // protobuf is little endian
+   p[0] = v;
+   p[1] = v >> 8;
+   p[2] = v >> 16;
+   p[3] = v >> 24;
+   return p + 4;
+}
+
+
+static char *pb_bytes(char *p, int field, const void *d, int len)
+{
+   p = pb_varint(p, (field << 3) | PB_BYTES);
+   p = pb_varint(p, len);
+   memcpy(p, d, len);
+   return p + len;
+}
+
+
+/*! Encode a socket address as address and port field of a Message.
+ *  IPv4-mapped IPv6 addresses are logged as IPv4 addresses.
+ *  @return Returns the pointer to the end of the encoded fields.
+ */
+static char *pb_addr(char *p, const struct sockaddr *sa, int afield, int pfield)
+{
+   const struct sockaddr_in *sin;
+   const struct sockaddr_in6 *sin6;
+
+   if (sa->sa_family == AF_INET)
+   {
+      sin = (const struct sockaddr_in*) sa;
+      p = pb_uint(p, DTM_FAMILY, DT_FAMILY_INET);
+      p = pb_bytes(p, afield, &sin->sin_addr, 4);
+      return pb_uint(p, pfield, ntohs(sin->sin_port));
+   }
+
+   if (sa->sa_family == AF_INET6)
+   {
+      sin6 = (const struct sockaddr_in6*) sa;
+      if (IN6_IS_ADDR_V4MAPPED(&sin6->sin6_addr))
+      {
+         p = pb_uint(p, DTM_FAMILY, DT_FAMILY_INET);
+         p = pb_bytes(p, afield, &sin6->sin6_addr.s6_addr[12], 4);
+      }
+      else
+      {
+         p = pb_uint(p, DTM_FAMILY, DT_FAMILY_INET6);
+         p = pb_bytes(p, afield, &sin6->sin6_addr, 16);
+      }
+      return pb_uint(p, pfield, ntohs(sin6->sin6_port));
+   }
+   return p;
+}
+
+
+/*! Write a buffer completely to the output.
+ *  @return Returns 0 on success or -1 in case of error.
+ */
+static int tap_write(const char *buf, int len)
+{
+   int n;
+
+   while (len > 0)
+   {
+      // a vanished reader must not raise SIGPIPE
+      if ((n = sock_ ? send(fd_, buf, len, MSG_NOSIGNAL) : write(fd_, buf, len)) == -1)
+      {
+         if (errno == EINTR)
+            continue;
+         return -1;
+      }
+      buf += n;
+      len -= n;
+   }
+   return 0;
+}
+
+
+/*! Send a Frame Streams control frame.
+ *  @param type Control frame type (FSTRM_xxx).
+ *  @param ctype Set to add the content type field.
+ *  @return Returns 0 on success or -1 in case of error.
+ */
+static int tap_control(int type, int ctype)
+{
+   char buf[64];
+   int len = 4;
+
+   // a control frame is escaped by a frame length of 0
+   put32(buf, 0);
+   put32(buf + 8, type);
+   if (ctype)
+   {
+      put32(buf + 12, FSTRM_CONTENT_TYPE);
+      put32(buf + 16, sizeof(content_type_) - 1);
+      memcpy(buf + 20, content_type_, sizeof(content_type_) - 1);
+      len += 8 + sizeof(content_type_) - 1;
+   }
+   put32(buf + 4, len);
+   return tap_write(buf, len + 8);
+}
+
+
+/*! Receive a Frame Streams control frame from the socket.
+ *  @param type Expected control frame type.
+ *  @return Returns 0 on success or -1 in case of error or if the frame is of
+ *  a different type.
+ */
+static int tap_recv_control(int type)
+{
+   char buf[FSTRM_MAX_CONTROL];
+   int len, n, i;
+
+   for (i = 0, len = 8; i < len; i += n)
+   {
+      if ((n = recv(fd_, buf + i, len - i, 0)) <= 0)
+         return -1;
+      if (i + n >= 8 && len == 8)
+      {
+         len = 8 + ntohl(*((uint32_t*) (buf + 4)));
+         if (*((uint32_t*) buf) || len < 12 || len > (int) sizeof(buf))
+            return -1;
+      }
+   }
+   return (int) ntohl(*((uint32_t*) (buf + 8))) == type ? 0 : -1;
+}
+
+
+/*! Connect to the Unix socket and perform the bidirectional Frame Streams
+ *  handshake.
+ *  @return Returns 0 on success or -1 in case of error.
+ */
+static int tap_connect(void)
+{
+   struct timeval tv = {1, 0};
+   struct sockaddr_un un;
+
+   memset(&un, 0, sizeof(un));
+   un.sun_family = AF_UNIX;
+   strncpy(un.sun_path, path_, sizeof(un.sun_path) - 1);
+
+   if ((fd_ = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+   {
+      log_msg(LOG_ERR, "could not create dnstap socket: %s", strerror(errno));
+      return -1;
+   }
+
+   // the handshake must not stall the writer
+   (void) setsockopt(fd_, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+   if (connect(fd_, (struct sockaddr*) &un, sizeof(un)) == -1)
+   {
+      log_msg(LOG_ERR, "could not connect to dnstap socket %s: %s", path_, strerror(errno));
+      goto fail;
+   }
+
+   if (tap_control(FSTRM_READY, 1) == -1 || tap_recv_control(FSTRM_ACCEPT) == -1 || tap_control(FSTRM_START, 1) == -1)
+   {
+      log_msg(LOG_ERR, "dnstap handshake on %s failed", path_);
+      goto fail;
+   }
+
+   log_msg(LOG_INFO, "connected to dnstap socket %s", path_);
+   return 0;
+
+fail:
+   (void) close(fd_);
+   fd_ = -1;
+   return -1;
+}
+
+
+/*! Close the output. The stream is terminated with a STOP frame.
+ */
+static void tap_disconnect(void)
+{
+   if (fd_ == -1)
+      return;
+
+   if (tap_control(FSTRM_STOP, 0) != -1 && sock_)
+      (void) tap_recv_control(FSTRM_FINISH);
+   (void) close(fd_);
+   fd_ = -1;
+}
+
+
+/*! Write the output buffer of the writer. If the socket is not connected,
+ *  it is reconnected at most once per TAP_RECONNECT ms, otherwise the frames
+ *  are lost.
+ */
+static void tap_flush(void)
+{
+   uint64_t now;
+
+   if (!wlen_)
+      return;
+
+   if (fd_ == -1 && sock_ && (now = clock_ms()) >= retry_)
+   {
+      retry_ = now + TAP_RECONNECT;
+      (void) tap_connect();
+   }
+
+   if (fd_ != -1 && tap_write(wbuf_, wlen_) == -1)
+   {
+      log_msg(LOG_ERR, "could not write to dnstap output %s: %s", path_, strerror(errno));
+      (void) close(fd_);
+      fd_ = -1;
+   }
+
+   if (fd_ != -1)
+      __atomic_store_n(&written_, written_ + wcnt_, __ATOMIC_RELAXED);
+   else
+      __atomic_store_n(&lost_, lost_ + wcnt_, __ATOMIC_RELAXED);
+   wlen_ = wcnt_ = 0;
+}
+
+
+/*! Collect the frames of all rings into the output buffer and write them.
+ *  @return Returns the number of frames.
+ */
+static int tap_drain(void)
+{
+   tap_rec_t *rec;
+   int i, cnt, n = 0;
+
+   cnt = __atomic_load_n(&ring_cnt_, __ATOMIC_ACQUIRE);
+   for (i = 0; i < cnt; i++)
+      for (; (rec = spsc_peek(&rings_[i])) != NULL; n++)
+      {
+         if (wlen_ + rec->len > TAP_WBUF_SIZE)
+            tap_flush();
+         memcpy(wbuf_ + wlen_, rec->buf + rec->off, rec->len);
+         wlen_ += rec->len;
+         wcnt_++;
+         spsc_release(&rings_[i]);
+      }
+
+   tap_flush();
+   return n;
+}
+
+
+#ifdef WITH_THREADS
+/*! Thread main function of the writer. It drains the rings until it is
+ *  stopped and all rings are empty.
+ */
+static void *tap_writer(void *p)
+{
+   struct timespec ts = {0, 0};
+   int stop, n;
+
+   (void) p;
+   for (;;)
+   {
+      stop = !__atomic_load_n(&running_, __ATOMIC_ACQUIRE);
+      if (!(n = tap_drain()) && stop)
+         break;
+      ts.tv_nsec = (n ? TAP_BUSY_MS : TAP_IDLE_MS) * 1000000L;
+      (void) nanosleep(&ts, NULL);
+   }
+   return NULL;
+}
+#endif
+
+
+/*! Open the dnstap output. This has to be called before privileges are
+ *  dropped.
+ *  @param path Path of the output file or "unix:" followed by the path of
+ *  a Unix socket.
+ *  @return Returns 0 on success or -1 in case of error.
+ */
+int dnstap_open(const char *path)
+{
+   sock_ = !strncmp(path, "unix:", 5);
+   if ((path_ = strdup(sock_ ? path + 5 : path)) == NULL)
+      return -1;
+
+   if (sock_)
+      return tap_connect();
+
+   if ((fd_ = open(path_, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1)
+   {
+      log_msg(LOG_ERR, "could not open dnstap file %s: %s", path_, strerror(errno));
+      return -1;
+   }
+   return tap_control(FSTRM_START, 1);
+}
+
+
+/*! Start the writer thread. Since threads do not survive fork() this has to
+ *  be called after backgrounding. The output is closed automatically at
+ *  exit.
+ *  @return Returns 0 on success or -1 in case of error.
+ */
+int dnstap_start(void)
+{
+#ifdef WITH_THREADS
+   int e;
+#endif
+
+   if (path_ == NULL)
+      return 0;
+
+   if (atexit(dnstap_close))
+      return -1;
+
+#ifdef WITH_THREADS
+   __atomic_store_n(&running_, 1, __ATOMIC_RELEASE);
+   if ((e = pthread_create(&writer_, NULL, tap_writer, NULL)))
+   {
+      running_ = 0;
+      log_msg(LOG_ERR, "could not create dnstap writer: %s", strerror(e));
+      return -1;
+   }
+#endif
+   return 0;
+}
+
+
+/*! Stop the writer thread after all pending frames are written and close
+ *  the output.
+ */
+void dnstap_close(void)
+{
+   if (path_ == NULL)
+      return;
+
+#ifdef WITH_THREADS
+   if (__atomic_load_n(&running_, __ATOMIC_ACQUIRE))
+   {
+      __atomic_store_n(&running_, 0, __ATOMIC_RELEASE);
+      (void) pthread_join(writer_, NULL);
+   }
+#endif
+
+   (void) tap_drain();
+   tap_disconnect();
+   free(path_);
+   path_ = NULL;
+}
+
+
+/*! Allocate a ring for a worker.
+ *  @return Returns a pointer to the ring or NULL if dnstap is disabled or
+ *  in case of error.
+ */
+spsc_t *dnstap_ring(void)
+{
+   spsc_t *r;
+
+   if (path_ == NULL || ring_cnt_ >= TAP_MAX_RINGS)
+      return NULL;
+
+   r = &rings_[ring_cnt_];
+   if (spsc_init(r, TAP_RING_SIZE, sizeof(tap_rec_t)) == -1)
+   {
+      log_msg(LOG_ERR, "could not allocate dnstap ring: %s", strerror(errno));
+      return NULL;
+   }
+   __atomic_store_n(&ring_cnt_, ring_cnt_ + 1, __ATOMIC_RELEASE);
+   return r;
+}
+
+
+/*! Log a DNS message in dnstap format.
+ *  @param r Pointer to the ring of the worker.
+ *  @param type Message type (DNSTAP_xxx).
+ *  @param tcp Set if the message was transported with TCP.
+ *  @param addr Socket address of the peer, i.e. of the client for
+ *  DNSTAP_CLIENT_xxx or of the NS for DNSTAP_FORWARDER_xxx.
+ *  @param qtime Time of the query.
+ *  @param rtime Time of the response or NULL for queries.
+ *  @param msg Pointer to the DNS message.
+ *  @param len Length of the message.
+ */
+void dnstap_log(spsc_t *r, int type, int tcp, const struct sockaddr *addr, const struct timeval *qtime,
+      const struct timeval *rtime, const char *msg, int len)
+{
+   int client = type == DNSTAP_CLIENT_QUERY || type == DNSTAP_CLIENT_RESPONSE;
+   tap_rec_t *rec;
+   char *p, *m;
+   int n;
+
+   if ((rec = spsc_reserve(r)) == NULL)
+   {
+      __atomic_store_n(&dropped_[r - rings_], dropped_[r - rings_] + 1, __ATOMIC_RELAXED);
+      return;
+   }
+
+   // encode the Message behind the space reserved for the headers
+   m = p = rec->buf + TAP_PREFIX;
+   p = pb_uint(p, DTM_TYPE, type);
+   p = pb_uint(p, DTM_PROTOCOL, tcp ? DT_PROTOCOL_TCP : DT_PROTOCOL_UDP);
+   if (client)
+      p = pb_addr(p, addr, DTM_QUERY_ADDRESS, DTM_QUERY_PORT);
+   else
+      p = pb_addr(p, addr, DTM_RESPONSE_ADDRESS, DTM_RESPONSE_PORT);
+   p = pb_uint(p, DTM_QUERY_TIME_SEC, qtime->tv_sec);
+   p = pb_fixed32(p, DTM_QUERY_TIME_NSEC, qtime->tv_usec * 1000);
+   if (rtime != NULL)
+   {
+      p = pb_uint(p, DTM_RESPONSE_TIME_SEC, rtime->tv_sec);
+      p = pb_fixed32(p, DTM_RESPONSE_TIME_NSEC, rtime->tv_usec * 1000);
+   }
+   // the message is omitted if it does not fit into the record
+   if (len + 8 <= (int) sizeof(rec->buf) - (p - rec->buf))
+      p = pb_bytes(p, rtime == NULL ? DTM_QUERY_MESSAGE : DTM_RESPONSE_MESSAGE, msg, len);
+   n = p - m;
+
+   // prepend the headers of the Dnstap message and the frame
+   p = rec->buf + 4;
+   p = pb_bytes(p, DT_VERSION, PACKAGE_STRING, sizeof(PACKAGE_STRING) - 1);
+   p = pb_uint(p, DT_TYPE, DT_TYPE_MESSAGE);
+   p = pb_varint(p, (DT_MESSAGE << 3) | PB_BYTES);
+   p = pb_varint(p, n);
+   rec->off = TAP_PREFIX - (p - rec->buf);
+   memmove(rec->buf + rec->off, rec->buf, p - rec->buf);
+   rec->len = TAP_PREFIX - rec->off + n;
+   put32(rec->buf + rec->off, rec->len - 4);
+   spsc_commit(r);
+
+#ifdef WITH_THREADS
+   if (!__atomic_load_n(&running_, __ATOMIC_ACQUIRE))
+#endif
+      (void) tap_drain();
+}
+
+
+/*! Return the statistic counters of the dnstap log.
+ *  @param written Pointer to a variable which receives the number of frames
+ *  written.
+ *  @param dropped Pointer to a variable which receives the number of frames
+ *  which were dropped because the ring was full or the output failed.
+ */
+void dnstap_stats(unsigned long *written, unsigned long *dropped)
+{
+   int i, cnt;
+
+   *written = __atomic_load_n(&written_, __ATOMIC_RELAXED);
+   *dropped = __atomic_load_n(&lost_, __ATOMIC_RELAXED);
+   cnt = __atomic_load_n(&ring_cnt_, __ATOMIC_ACQUIRE);
+   for (i = 0; i < cnt; i++)
+      *dropped += __atomic_load_n(&dropped_[i], __ATOMIC_RELAXED);
+}
@@ -0,0 +1,159 @@
+/* Copyright 2013-2024 Bernhard R. Fischer, 4096R/8E24F29D <bf@abenteuerland.at>
+ *
+ * This file is part of Utdns.
+ *
+ * Utdns is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * Utdns is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Utdns. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*! \file edns.c
+ *  \author Bernhard R. Fischer, <bf@abenteuerland.at>
+ *
+ *  This file contains functions to handle EDNS0 options (RFC 6891). Currently
+ *  this is the edns-tcp-keepalive option (RFC 7828) which is used on TCP
+ *  sessions of clients and on idle sessions to the NS.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+
+#include "utdns.h"
+
+
+// EDNS0 option code of edns-tcp-keepalive
+#define EDNS_OPT_KEEPALIVE 11
+
+
+static int get16(const char *p)
+{
+   return ((p[0] & 0xff) << 8) | (p[1] & 0xff);
+}
+
+
+static void put16(char *p, int v)
+{
+   p[0] = v >> 8;
+   p[1] = v;
+}
+
+
+/*! Find the OPT RR of a DNS message.
+ *  @param msg Pointer to the DNS message.
+ *  @param len Length of the message.
+ *  @param opt Pointer to a structure which receives the OPT RR.
+ *  @return Returns 0 on success or -1 if there is none or the message is
+ *  malformed.
+ */
+static int find_opt(const char *msg, int len, dns_rr_t *opt)
+{
+   dns_msg_t m;
+
+   if (dns_msg_init(&m, msg, len) == -1)
+      return -1;
+
+   while (dns_msg_next(&m, opt) == 1)
+      if (opt->section != DNS_SEC_QD && opt->type == RR_TYPE_OPT)
+         return 0;
+   return -1;
+}
+
+
+/*! Find an option within the OPT RR.
+ *  @param msg Pointer to the DNS message.
+ *  @param opt Pointer to the OPT RR.
+ *  @param code Option code.
+ *  @return Returns the offset of the option or -1 if it is not present.
+ */
+static int find_option(const char *msg, const dns_rr_t *opt, int code)
+{
+   int off, end;
+
+   end = opt->rdata + opt->rdlen;
+   for (off = opt->rdata; off + 4 <= end; off += 4 + get16(msg + off + 2))
+      if (get16(msg + off) == code)
+         return off + 4 + get16(msg + off + 2) <= end ? off : -1;
+   return -1;
+}
+
+
+/*! Check if a query contains the edns-tcp-keepalive option.
+ *  @param msg Pointer to the DNS query.
+ *  @param opt Pointer to the OPT RR of the query as returned by
+ *  dns_query_parse(), opt->off is -1 if there is none.
+ *  @return Returns 1 if the option is present, otherwise 0.
+ */
+int edns_keepalive(const char *msg, const dns_rr_t *opt)
+{
+   return opt->off != -1 && find_option(msg, opt, EDNS_OPT_KEEPALIVE) != -1;
+}
+
+
+/*! Set the edns-tcp-keepalive option of an answer. An existing option is
+ *  replaced, otherwise it is appended to the OPT RR. Nothing is changed if
+ *  the answer has no OPT RR.
+ *  @param msg Pointer to the DNS answer.
+ *  @param len Length of the answer.
+ *  @param size Total size of the buffer msg.
+ *  @param timeout Idle timeout in units of 100 ms.
+ *  @return Returns the new length of the answer.
+ */
+int edns_set_keepalive(char *msg, int len, int size, int timeout)
+{
+   dns_rr_t opt;
+   int off, olen, end;
+
+   if (find_opt(msg, len, &opt) == -1)
+      return len;
+
+   // remove an existing option
+   if ((off = find_option(msg, &opt, EDNS_OPT_KEEPALIVE)) != -1)
+   {
+      olen = 4 + get16(msg + off + 2);
+      memmove(msg + off, msg + off + olen, len - off - olen);
+      len -= olen;
+      opt.rdlen -= olen;
+   }
+
+   // append option to the RDATA of the OPT RR
+   end = opt.rdata + opt.rdlen;
+   if (len + 6 <= size)
+   {
+      memmove(msg + end + 6, msg + end, len - end);
+      put16(msg + end, EDNS_OPT_KEEPALIVE);
+      put16(msg + end + 2, 2);
+      put16(msg + end + 4, timeout);
+      opt.rdlen += 6;
+      len += 6;
+   }
+   put16(msg + opt.rdata - 2, opt.rdlen);
+   return len;
+}
+
+
+/*! Return the timeout of the edns-tcp-keepalive option of an answer.
+ *  @param msg Pointer to the DNS answer.
+ *  @param len Length of the answer.
+ *  @return Returns the idle timeout in units of 100 ms or -1 if the answer
+ *  has no such option.
+ */
+int edns_get_keepalive(const char *msg, int len)
+{
+   dns_rr_t opt;
+   int off;
+
+   if (find_opt(msg, len, &opt) == -1 || (off = find_option(msg, &opt, EDNS_OPT_KEEPALIVE)) == -1 || get16(msg + off + 2) != 2)
+      return -1;
+   return get16(msg + off + 4);
+}
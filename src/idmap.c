@@ -0,0 +1,137 @@
+/* Copyright 2013-2024 Bernhard R. Fischer, 4096R/8E24F29D <bf@abenteuerland.at>
+ *
+ * This file is part of Utdns.
+ *
+ * Utdns is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * Utdns is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Utdns. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*! \file idmap.c
+ *  \author Bernhard R. Fischer, <bf@abenteuerland.at>
+ *
+ *  This file contains the message ID mapping. Queries of unrelated clients
+ *  are multiplexed onto a single TCP session to the NS. Since different
+ *  clients may use the same ID, the ID of every query is replaced by one
+ *  which is unique on the session and the original one is restored in the
+ *  answer. All operations are O(1).
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "utdns.h"
+
+
+/*! Initialize an ID map. All IDs are free afterwards. They are handed out in
+ *  random order.
+ *  @param map Pointer to the ID map.
+ *  @return Returns 0 on success or -1 in case of error.
+ */
+int idmap_init(idmap_t *map)
+{
+   int i, j;
+   uint16_t id;
+
+   if ((map->slot = calloc(IDMAP_SIZE, sizeof(*map->slot))) == NULL)
+   {
+      log_msg(LOG_ERR, "could not allocate idmap: %s", strerror(errno));
+      return -1;
+   }
+
+   if ((map->ring = malloc(IDMAP_SIZE * sizeof(*map->ring))) == NULL)
+   {
+      log_msg(LOG_ERR, "could not allocate idmap: %s", strerror(errno));
+      free(map->slot);
+      map->slot = NULL;
+      return -1;
+   }
+
+   // shuffle IDs (Fisher-Yates)
+   for (i = 0; i < IDMAP_SIZE; i++)
+      map->ring[i] = i;
+   for (i = IDMAP_SIZE - 1; i > 0; i--)
+   {
+      j = random() % (i + 1);
+      id = map->ring[i];
+      map->ring[i] = map->ring[j];
+      map->ring[j] = id;
+   }
+
+   map->head = 0;
+   map->cnt = IDMAP_SIZE;
+   return 0;
+}
+
+
+/*! Free all memory of an ID map.
+ *  @param map Pointer to the ID map.
+ */
+void idmap_free(idmap_t *map)
+{
+   free(map->slot);
+   free(map->ring);
+   map->slot = NULL;
+   map->ring = NULL;
+   map->cnt = 0;
+}
+
+
+/*! Allocate a free ID and associate it with an object.
+ *  @param map Pointer to the ID map.
+ *  @param ptr Pointer to the object, must not be NULL.
+ *  @return Returns the ID (0 - 65535) or -1 if all IDs are in use.
+ */
+int idmap_get(idmap_t *map, void *ptr)
+{
+   int id;
+
+   if (!map->cnt)
+      return -1;
+
+   id = map->ring[map->head++];
+   map->cnt--;
+   map->slot[id] = ptr;
+   return id;
+}
+
+
+/*! Look up the object associated with an ID.
+ *  @param map Pointer to the ID map.
+ *  @param id ID.
+ *  @return Returns the pointer to the object or NULL if the ID is unused.
+ */
+void *idmap_lookup(const idmap_t *map, int id)
+{
+   return map->slot[id & (IDMAP_SIZE - 1)];
+}
+
+
+/*! Release an ID. It is appended to the end of the ring of free IDs.
+ *  @param map Pointer to the ID map.
+ *  @param id ID which was previously returned by idmap_get().
+ */
+void idmap_put(idmap_t *map, int id)
+{
+   id &= IDMAP_SIZE - 1;
+   if (map->slot[id] == NULL)
+      return;
+
+   map->slot[id] = NULL;
+   map->ring[(uint16_t) (map->head + map->cnt)] = id;
+   map->cnt++;
+}
+
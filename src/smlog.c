@@ -41,6 +41,8 @@
 #include <pthread.h>
 #endif
 
+#include "utdns.h"
+
 
 #define SIZE_1K 1024
 #define TIMESTRLEN 64
@@ -50,10 +52,67 @@
 #define LOG_PRI(p) ((p) & LOG_PRIMASK)
 #endif
 
+#ifdef WITH_THREADS
+#define THREAD_LOCAL __thread
+#else
+#define THREAD_LOCAL
+#endif
+
+#ifdef WITH_THREADS
+// number of records of the ring of a thread, must be a power of 2
+#define LOG_RING_SIZE 4096
+// maximum number of threads with a ring: the workers, the main thread, and
+// the dnstap writer
+#define LOG_MAX_RINGS (MAX_WORKERS + 2)
+// maximum length of a message within a record
+#define LOG_MSG_SIZE 480
+// time [ms] the writer sleeps if all rings are empty
+#define LOG_IDLE_MS 10
+// time [ms] the writer sleeps after records were written
+#define LOG_BUSY_MS 1
+// size of the output buffer of the writer
+#define LOG_WBUF_SIZE (64 * SIZE_1K)
+
+//! log record passed from a thread to the writer
+typedef struct log_rec
+{
+   struct timeval tv;               // time of the message
+   int level;                       // log priority
+   int id;                          // id of the thread
+   char msg[LOG_MSG_SIZE];          // formatted message
+} log_rec_t;
+#endif
+
 static const char *flty_[8] = {"emerg", "alert", "crit", "err", "warning", "notice", "info", "debug"};
 //! FILE pointer to log
 static FILE *log_ = NULL;
 static int level_ = LOG_INFO;
+//! formatted time of the last log line of the thread, updated once per second
+static THREAD_LOCAL char timestr_[TIMESTRLEN] = "";
+static THREAD_LOCAL time_t timestr_sec_ = 0;
+
+#ifdef WITH_THREADS
+//! serializes the output if there is no writer thread, and ring allocation
+static pthread_mutex_t mutex_ = PTHREAD_MUTEX_INITIALIZER;
+//! rings of the threads, they are kept until the program exits
+static spsc_t rings_[LOG_MAX_RINGS];
+//! number of messages dropped because the ring was full, per ring
+static unsigned long dropped_[LOG_MAX_RINGS];
+//! number of rings in use
+static int ring_cnt_ = 0;
+//! ring of the current thread, NULL if not yet allocated
+static THREAD_LOCAL spsc_t *ring_ = NULL;
+//! set if no ring could be allocated for the current thread
+static THREAD_LOCAL int ring_failed_ = 0;
+//! set while the writer thread is running
+static int running_ = 0;
+static pthread_t writer_;
+//! output buffer of the writer
+static char wbuf_[LOG_WBUF_SIZE];
+static int wlen_ = 0;
+//! number of dropped messages which were already reported by the writer
+static unsigned long dropped_rep_ = 0;
+#endif
 
 
 void __attribute__((constructor)) init_log0(void)
@@ -78,7 +137,252 @@ FILE *init_log(const char *s, int level)
 }
 
 
-/*! Log a message to a file.
+/*! Format the prefix of a log line, i.e. the time, the time since the
+ *  previous line, the thread id, and the priority.
+ *  @param buf Pointer to the destination buffer.
+ *  @param size Size of buf.
+ *  @param level Logging priority.
+ *  @param id Id of the thread.
+ *  @param tv Time of the message.
+ *  @param last Time of the previous line, it is updated. Every output path has
+ *  its own, thus the writer thread and synchronous logging share no state.
+ *  @return Returns the length of the prefix.
+ */
+static int log_prefix(char *buf, int size, int level, int id, const struct timeval *tv, struct timeval *last)
+{
+   struct timeval tr;
+   struct tm tm;
+   char timez[TIMESTRLEN] = "";
+   int n;
+
+   if (!last->tv_sec) *last = *tv;
+
+   tr.tv_sec = tv->tv_sec - last->tv_sec;
+   tr.tv_usec = tv->tv_usec - last->tv_usec;
+   if (tr.tv_usec < 0)
+   {
+      tr.tv_usec += 1000000;
+      tr.tv_sec--;
+   }
+
+   // the time string changes only once per second
+   if (tv->tv_sec != timestr_sec_ && localtime_r(&tv->tv_sec, &tm) != NULL)
+   {
+      //(void) strftime(timestr_, TIMESTRLEN, "%a, %d %b %Y %H:%M:%S", &tm);
+      (void) strftime(timestr_, TIMESTRLEN, "%H:%M:%S", &tm);
+      //(void) strftime(timez, TIMESTRLEN, "%z", &tm);
+      timestr_sec_ = tv->tv_sec;
+   }
+
+   n = snprintf(buf, size, "%s.%03d %s (+%2d.%03d) %d:[%7s] ", timestr_, (int) (tv->tv_usec / 1000), timez, (int) tr.tv_sec, (int) (tr.tv_usec / 1000), id, flty_[level]);
+   *last = *tv;
+   return n;
+}
+
+
+#ifdef WITH_THREADS
+static void log_wflush(void)
+{
+   if (wlen_ && log_ != NULL)
+   {
+      (void) fwrite(wbuf_, 1, wlen_, log_);
+      (void) fflush(log_);
+   }
+   wlen_ = 0;
+}
+
+
+/*! Append a message to the output buffer of the writer or send it to syslog
+ *  if there is no output stream.
+ */
+static void log_wmsg(int level, int id, const struct timeval *tv, const char *msg)
+{
+   static struct timeval last = {0, 0};
+
+   if (log_ == NULL)
+   {
+      syslog(level | LOG_DAEMON, "%s", msg);
+      return;
+   }
+
+   if (wlen_ + TIMESTRLEN * 2 + LOG_MSG_SIZE > LOG_WBUF_SIZE)
+      log_wflush();
+
+   wlen_ += log_prefix(wbuf_ + wlen_, LOG_WBUF_SIZE - wlen_, level, id, tv, &last);
+   wlen_ += snprintf(wbuf_ + wlen_, LOG_WBUF_SIZE - wlen_, "%s\n", msg);
+}
+
+
+/*! Write all records of all rings. The records of the rings are merged by
+ *  their timestamps thus the lines are in chronological order.
+ *  @return Returns the number of records written.
+ */
+static int log_drain(void)
+{
+   static struct timeval tv = {0, 0};
+   log_rec_t *rec, *min;
+   spsc_t *r = NULL;
+   unsigned long d;
+   char buf[SIZE_1K];
+   int i, cnt, n;
+
+   cnt = __atomic_load_n(&ring_cnt_, __ATOMIC_ACQUIRE);
+   for (n = 0;; n++)
+   {
+      min = NULL;
+      for (i = 0; i < cnt; i++)
+         if ((rec = spsc_peek(&rings_[i])) != NULL && (min == NULL || timercmp(&rec->tv, &min->tv, <)))
+         {
+            min = rec;
+            r = &rings_[i];
+         }
+      if (min == NULL)
+         break;
+
+      tv = min->tv;
+      log_wmsg(min->level, min->id, &min->tv, min->msg);
+      spsc_release(r);
+   }
+
+   if ((d = log_dropped()) != dropped_rep_)
+   {
+      snprintf(buf, sizeof(buf), "%lu log messages dropped, ring full", d - dropped_rep_);
+      dropped_rep_ = d;
+      // keep the order, use the time of the last record
+      if (!tv.tv_sec)
+         clock_wall(&tv);
+      log_wmsg(LOG_WARNING, 0, &tv, buf);
+   }
+
+   log_wflush();
+   return n;
+}
+
+
+/*! Thread main function of the writer. It drains the rings until the writer
+ *  is stopped and all rings are empty.
+ */
+static void *log_writer(void *p)
+{
+   struct timespec ts = {0, 0};
+   int stop, n;
+
+   (void) p;
+   for (;;)
+   {
+      stop = !__atomic_load_n(&running_, __ATOMIC_ACQUIRE);
+      if (!(n = log_drain()) && stop)
+         break;
+      // poll more often while messages are coming in
+      ts.tv_nsec = (n ? LOG_BUSY_MS : LOG_IDLE_MS) * 1000000L;
+      (void) nanosleep(&ts, NULL);
+   }
+   return NULL;
+}
+
+
+/*! Return the ring of the current thread. It is allocated on the first call.
+ *  @return Returns a pointer to the ring or NULL if no ring is available.
+ */
+static spsc_t *log_ring(void)
+{
+   int i;
+
+   if (ring_ != NULL || ring_failed_)
+      return ring_;
+
+   pthread_mutex_lock(&mutex_);
+   i = ring_cnt_;
+   if (i < LOG_MAX_RINGS && spsc_init(&rings_[i], LOG_RING_SIZE, sizeof(log_rec_t)) != -1)
+   {
+      ring_ = &rings_[i];
+      __atomic_store_n(&ring_cnt_, i + 1, __ATOMIC_RELEASE);
+   }
+   else
+      ring_failed_ = 1;
+   pthread_mutex_unlock(&mutex_);
+
+   return ring_;
+}
+
+
+/*! Start the writer thread. Afterwards log_msg() does not write to the log
+ *  anymore but only formats the message into a record of the ring of the
+ *  calling thread. If the ring is full the message is dropped and counted.
+ *  The writer is stopped automatically at exit. Since threads do not survive
+ *  fork() this has to be called after backgrounding.
+ *  @return Returns 0 on success, otherwise -1 and logging continues
+ *  synchronously.
+ */
+int log_start(void)
+{
+   static int atexit_ = 0;
+   int e;
+
+   if (running_)
+      return 0;
+
+   __atomic_store_n(&running_, 1, __ATOMIC_RELEASE);
+   if ((e = pthread_create(&writer_, NULL, log_writer, NULL)))
+   {
+      running_ = 0;
+      log_msg(LOG_ERR, "could not create log writer: %s", strerror(e));
+      return -1;
+   }
+
+   if (!atexit_ && !atexit(log_stop))
+      atexit_ = 1;
+   return 0;
+}
+
+
+/*! Stop the writer thread after it has written all pending records. Further
+ *  messages are written synchronously.
+ */
+void log_stop(void)
+{
+   if (!__atomic_load_n(&running_, __ATOMIC_ACQUIRE))
+      return;
+
+   __atomic_store_n(&running_, 0, __ATOMIC_RELEASE);
+   (void) pthread_join(writer_, NULL);
+}
+
+
+/*! Return the total number of messages which were dropped because the ring
+ *  of a thread was full.
+ */
+unsigned long log_dropped(void)
+{
+   unsigned long d = 0;
+   int i, cnt;
+
+   cnt = __atomic_load_n(&ring_cnt_, __ATOMIC_ACQUIRE);
+   for (i = 0; i < cnt; i++)
+      d += __atomic_load_n(&dropped_[i], __ATOMIC_RELAXED);
+   return d;
+}
+#else
+int log_start(void)
+{
+   return 0;
+}
+
+
+void log_stop(void)
+{
+}
+
+
+unsigned long log_dropped(void)
+{
+   return 0;
+}
+#endif
+
+
+/*! Log a message to a file. If the writer thread is running the message is
+ *  passed to it through the ring of the thread.
  *  @param out Open FILE pointer
  *  @param lf Logging priority (equal to syslog)
  *  @param fmt Format string
@@ -86,64 +390,68 @@ FILE *init_log(const char *s, int level)
  */
 void vlog_msgf(FILE *out, int lf, const char *fmt, va_list ap)
 {
-#ifdef WITH_THREADS
-   static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
-#endif
-   static struct timeval tv_stat = {0, 0};
-   struct timeval tv, tr;
-   struct tm *tm;
-   time_t t;
-   char timestr[TIMESTRLEN] = "", timez[TIMESTRLEN] = "";
+   // time of the previous line, protected by mutex_
+   static struct timeval last = {0, 0};
+   struct timeval tv;
    int level = LOG_PRI(lf), id = 0;
+   char pfx[TIMESTRLEN * 2];
    char buf[SIZE_1K];
+#ifdef WITH_THREADS
+   log_rec_t *rec;
+   spsc_t *r;
+#endif
 
    if (level_ < level) return;
 
-   //t = time(NULL);
-   if (gettimeofday(&tv, NULL) == -1)
-      fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, strerror(errno)), exit(EXIT_FAILURE);
+   // use the cached time of the event loop
+   clock_wall(&tv);
 
-   if (!tv_stat.tv_sec) tv_stat = tv;
-
-   tr.tv_sec = tv.tv_sec - tv_stat.tv_sec;
-   tr.tv_usec = tv.tv_usec - tv_stat.tv_usec;
-   if (tr.tv_usec < 0)
-   {
-      tr.tv_usec += 1000000;
-      tr.tv_sec--;
-   }
-
-   t = tv.tv_sec;
-   if ((tm = localtime(&t)))
+#ifdef WITH_THREADS
+   id = sm_thread_id();
+   if (__atomic_load_n(&running_, __ATOMIC_ACQUIRE) && (r = log_ring()) != NULL)
    {
-      //(void) strftime(timestr, TIMESTRLEN, "%a, %d %b %Y %H:%M:%S", tm);
-      (void) strftime(timestr, TIMESTRLEN, "%H:%M:%S", tm);
-      //(void) strftime(timez, TIMESTRLEN, "%z", tm);
+      if ((rec = spsc_reserve(r)) == NULL)
+      {
+         __atomic_store_n(&dropped_[r - rings_], dropped_[r - rings_] + 1, __ATOMIC_RELAXED);
+         return;
+      }
+      rec->tv = tv;
+      rec->level = level;
+      rec->id = id;
+      (void) vsnprintf(rec->msg, sizeof(rec->msg), fmt, ap);
+      spsc_commit(r);
+      return;
    }
+#endif
 
+   vsnprintf(buf, SIZE_1K, fmt, ap);
    if (out)
    {
 #ifdef WITH_THREADS
-      int sm_thread_id(void);
-      id = sm_thread_id();
-      pthread_mutex_lock(&mutex);
+      pthread_mutex_lock(&mutex_);
 #endif
-      fprintf(out, "%s.%03d %s (+%2d.%03d) %d:[%7s] ", timestr, (int) (tv.tv_usec / 1000), timez, (int) tr.tv_sec, (int) (tr.tv_usec / 1000), id, flty_[level]);
-      vfprintf(out, fmt, ap);
-      fprintf(out, "\n");
+      (void) log_prefix(pfx, sizeof(pfx), level, id, &tv, &last);
+      fprintf(out, "%s%s\n", pfx, buf);
 #ifdef WITH_THREADS
-      pthread_mutex_unlock(&mutex);
+      pthread_mutex_unlock(&mutex_);
 #endif
    }
    else
    {
       // log to syslog if no output stream is available
-      //vsyslog(level | LOG_DAEMON, fmt, ap);
-      vsnprintf(buf, SIZE_1K, fmt, ap);
       syslog(level | LOG_DAEMON, "%s", buf);
-
    }
-   tv_stat = tv;
+}
+
+
+/*! Check if a message of the given priority would be logged. Callers use
+ *  this to skip the formatting of expensive arguments.
+ *  @param lf Log priority.
+ *  @return Returns 1 if the message would be logged, otherwise 0.
+ */
+int log_enabled(int lf)
+{
+   return LOG_PRI(lf) <= level_;
 }
 
 
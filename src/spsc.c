@@ -0,0 +1,106 @@
+/* Copyright 2013-2024 Bernhard R. Fischer, 4096R/8E24F29D <bf@abenteuerland.at>
+ *
+ * This file is part of Utdns.
+ *
+ * Utdns is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * Utdns is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Utdns. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*! \file spsc.c
+ *  \author Bernhard R. Fischer, <bf@abenteuerland.at>
+ *
+ *  This file contains a lock-free ring buffer of fixed-size records for a
+ *  single producer and a single consumer thread. The producer reserves a
+ *  record, fills it, and commits it. The consumer peeks at the oldest record
+ *  and releases it after processing. Head and tail are free-running counters
+ *  which are only written by one side each, thus no locks are needed. A full
+ *  ring is reported to the producer, it never blocks.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+
+#include "utdns.h"
+
+
+/*! Initialize a ring.
+ *  @param r Pointer to the ring.
+ *  @param cnt Number of records, this must be a power of 2.
+ *  @param rec_size Size of a record.
+ *  @return Returns 0 on success or -1 if memory could not be allocated.
+ */
+int spsc_init(spsc_t *r, unsigned cnt, unsigned rec_size)
+{
+   if ((r->buf = malloc((size_t) cnt * rec_size)) == NULL)
+      return -1;
+
+   r->mask = cnt - 1;
+   r->rec_size = rec_size;
+   r->head = r->tail = 0;
+   return 0;
+}
+
+
+void spsc_free(spsc_t *r)
+{
+   free(r->buf);
+   r->buf = NULL;
+}
+
+
+/*! Reserve the next record for the producer. The record is not visible to
+ *  the consumer before spsc_commit() is called.
+ *  @param r Pointer to the ring.
+ *  @return Returns a pointer to the record or NULL if the ring is full.
+ */
+void *spsc_reserve(spsc_t *r)
+{
+   unsigned tail = r->tail;
+
+   if (tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) > r->mask)
+      return NULL;
+   return r->buf + (size_t) (tail & r->mask) * r->rec_size;
+}
+
+
+/*! Publish the record returned by spsc_reserve() to the consumer.
+ */
+void spsc_commit(spsc_t *r)
+{
+   __atomic_store_n(&r->tail, r->tail + 1, __ATOMIC_RELEASE);
+}
+
+
+/*! Return the oldest record to the consumer.
+ *  @param r Pointer to the ring.
+ *  @return Returns a pointer to the record or NULL if the ring is empty.
+ */
+void *spsc_peek(spsc_t *r)
+{
+   unsigned head = r->head;
+
+   if (head == __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE))
+      return NULL;
+   return r->buf + (size_t) (head & r->mask) * r->rec_size;
+}
+
+
+/*! Remove the record returned by spsc_peek() from the ring, the producer may
+ *  reuse it afterwards.
+ */
+void spsc_release(spsc_t *r)
+{
+   __atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,197 @@
+/* Copyright 2013-2024 Bernhard R. Fischer, 4096R/8E24F29D <bf@abenteuerland.at>
+ *
+ * This file is part of Utdns.
+ *
+ * Utdns is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * Utdns is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Utdns. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*! \file timer.c
+ *  \author Bernhard R. Fischer, <bf@abenteuerland.at>
+ *
+ *  This file contains a hierarchical timer wheel. The wheel has TW_LEVELS
+ *  levels of TW_SLOTS slots each. A slot of level 0 covers one tick (1 ms),
+ *  a slot of level n covers TW_SLOTS^n ticks. A timer is put into the lowest
+ *  level which covers its expiry. Whenever the wheel passes a slot of a higher
+ *  level, its timers are cascaded down to the lower levels. Adding and
+ *  removing a timer is O(1). Occupied slots are tracked in a bitmap per level
+ *  thus the time until the next expiry is found quickly and ticks without
+ *  timers are skipped.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+
+#include "utdns.h"
+
+
+#define TW_BITS 6
+#define TW_MASK (TW_SLOTS - 1)
+// number of ticks covered by the wheel
+#define TW_RANGE ((uint64_t) 1 << (TW_BITS * TW_LEVELS))
+
+
+/*! Initialize an empty timer wheel.
+ *  @param tw Pointer to the wheel.
+ *  @param now Current time in ticks.
+ *  @param p Pointer which is passed to the callback functions of the timers.
+ */
+void tw_init(twheel_t *tw, uint64_t now, void *p)
+{
+   memset(tw, 0, sizeof(*tw));
+   tw->now = now;
+   tw->p = p;
+}
+
+
+/*! Link a timer into the slot which covers its expiry.
+ */
+static void tw_link(twheel_t *tw, wtimer_t *t)
+{
+   uint64_t delta = t->expire - tw->now;
+   int l, i;
+
+   for (l = 0; l < TW_LEVELS - 1 && delta >= (uint64_t) 1 << (TW_BITS * (l + 1)); l++);
+   i = (t->expire >> (TW_BITS * l)) & TW_MASK;
+
+   t->slot = l * TW_SLOTS + i;
+   t->pprev = &tw->slot[l][i];
+   if ((t->next = tw->slot[l][i]) != NULL)
+      t->next->pprev = &t->next;
+   tw->slot[l][i] = t;
+   tw->bits[l] |= (uint64_t) 1 << i;
+}
+
+
+/*! Remove a timer. Nothing happens if the timer is not pending.
+ *  @param tw Pointer to the wheel.
+ *  @param t Pointer to the timer.
+ */
+void tw_del(twheel_t *tw, wtimer_t *t)
+{
+   if (t->pprev == NULL)
+      return;
+
+   if ((*t->pprev = t->next) != NULL)
+      t->next->pprev = t->pprev;
+   if (tw->slot[t->slot / TW_SLOTS][t->slot % TW_SLOTS] == NULL)
+      tw->bits[t->slot / TW_SLOTS] &= ~((uint64_t) 1 << (t->slot % TW_SLOTS));
+   t->next = NULL;
+   t->pprev = NULL;
+   tw->cnt--;
+}
+
+
+/*! Add a timer to the wheel. If the timer is already pending it is moved to
+ *  the new expiry.
+ *  @param tw Pointer to the wheel.
+ *  @param t Pointer to the timer. The members func and data have to be set.
+ *  @param expire Expiry time in ticks. Timers which are due already expire
+ *  with the next tick. Timers beyond the range of the wheel are clamped.
+ */
+void tw_add(twheel_t *tw, wtimer_t *t, uint64_t expire)
+{
+   tw_del(tw, t);
+
+   if (expire <= tw->now)
+      expire = tw->now + 1;
+   else if (expire - tw->now >= TW_RANGE)
+      expire = tw->now + TW_RANGE - 1;
+
+   t->expire = expire;
+   tw_link(tw, t);
+   tw->cnt++;
+}
+
+
+/*! Return the number of ticks until the next slot of the wheel has to be
+ *  processed. This is either the expiry of a timer or the cascade of a higher
+ *  level slot, thus the result may be earlier than the next expiry.
+ *  @param tw Pointer to the wheel.
+ *  @return Returns the number of ticks (at least 1) or -1 if there is no
+ *  pending timer.
+ */
+int64_t tw_next(const twheel_t *tw)
+{
+   uint64_t bits, blk, next, min = 0;
+   int l, cur, k;
+
+   for (l = 0; l < TW_LEVELS; l++)
+   {
+      if (!tw->bits[l])
+         continue;
+
+      // the slot after the current one is the nearest
+      blk = tw->now >> (TW_BITS * l);
+      cur = (blk + 1) & TW_MASK;
+      bits = tw->bits[l];
+      bits = cur ? (bits >> cur) | (bits << (TW_SLOTS - cur)) : bits;
+      k = __builtin_ctzll(bits);
+
+      next = (blk + 1 + k) << (TW_BITS * l);
+      if (!min || next < min)
+         min = next;
+   }
+   return min ? (int64_t) (min - tw->now) : -1;
+}
+
+
+/*! Advance the wheel to the current time and call the callback function of
+ *  all timers which expired meanwhile. A timer is removed from the wheel
+ *  before its callback is called, thus the callback may add it again.
+ *  @param tw Pointer to the wheel.
+ *  @param now Current time in ticks.
+ */
+void tw_advance(twheel_t *tw, uint64_t now)
+{
+   wtimer_t *t, *list;
+   int64_t d;
+   int l, i;
+
+   while (tw->now < now)
+   {
+      // skip ticks which have nothing to do
+      if ((d = tw_next(tw)) == -1 || tw->now + d > now)
+      {
+         tw->now = now;
+         break;
+      }
+      tw->now += d;
+
+      // cascade timers of higher levels, highest first
+      for (l = TW_LEVELS - 1; l > 0; l--)
+      {
+         if (tw->now & (((uint64_t) 1 << (TW_BITS * l)) - 1))
+            continue;
+
+         i = (tw->now >> (TW_BITS * l)) & TW_MASK;
+         list = tw->slot[l][i];
+         tw->slot[l][i] = NULL;
+         tw->bits[l] &= ~((uint64_t) 1 << i);
+         while ((t = list) != NULL)
+         {
+            list = t->next;
+            tw_link(tw, t);
+         }
+      }
+
+      i = tw->now & TW_MASK;
+      while ((t = tw->slot[0][i]) != NULL)
+      {
+         tw_del(tw, t);
+         t->func(tw->p, t->data);
+      }
+   }
+}
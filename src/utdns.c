@@ -23,7 +23,15 @@
  *  with TCP. The NS IP address has to be specified as command line argument.
  *  The responses are sent back again. Therefore, Utdns manages an internal
  *  transaction state table. Stale states are timed out after TIMEOUT secondes.
- *  The state table keeps MAX_TRX concurrent transactions.
+ *  The state table grows on demand up to MAX_TRX concurrent transactions (both
+ *  can be changed at runtime). The queries are
+ *  pipelined on a small pool of persistent TCP sessions to the NS (RFC 7766)
+ *  and the answers are matched to the transactions by their message ID.
+ *  Answers are cached according to their TTL thus repeated queries are
+ *  answered without contacting the NS.
+ *  Clients may send their queries with TCP as well. Many queries may be
+ *  outstanding on a client session and the answers are sent in the order in
+ *  which they complete (RFC 7766).
  *  In order to bind to the privileged port 53, Utdns has to started as root.
  *  It will immediately drop privileges to NOBODY.
  *
@@ -34,37 +42,113 @@
  * redirect all incoming traffic
  * iptables -t nat -A PREROUTING -p udp --dport 53 -j REDIRECT --to-ports 5300
  */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#else
+#define PACKAGE_VERSION ""
+#endif
+
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <signal.h>
 #include <netdb.h>
 #include <syslog.h>
 #include <time.h>
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/socket.h>
-#include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
 #include <sys/stat.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>     // inet_addr()
-
-#ifdef HAVE_CONFIG_H
-#include "config.h"
-#else
-#define PACKAGE_VERSION ""
+#ifdef WITH_THREADS
+#include <pthread.h>
 #endif
 
-// maximum number of concurrent transactions
-#define MAX_TRX 512
-// timeout [s] after which a stale transaction is removed
-#define TIMEOUT 10
+#include "utdns.h"
 
+// default maximum number of concurrent transactions
+#define MAX_TRX 4096
+// upper limit of the maximum number of concurrent transactions
+#define MAX_TRX_LIMIT 1048576
+// number of transactions by which the transaction table grows
+#define TRX_CHUNK 256
+// default timeout [s] after which a stale transaction is removed
+#define TIMEOUT 10
+// maximum time [ms] epoll_wait() blocks, signals are checked at least that often
+#define MAX_WAIT 1000
+// interval [ms] of the housekeeping timer
+#define HOUSEKEEPING_INTERVAL 1000
+// default maximum number of concurrent TCP sessions to the NS
+#define MAX_NS_CONN 4
+// number of pipelined queries on a session before another one is opened
+#define NS_CONN_LOAD 64
+// idle time [s] after which an unused session to the NS is closed
+#define NS_IDLE_TIMEOUT 10
+// default minimum number of open sessions to each NS
+#define MIN_NS_CONN 1
+// idle time [ms] after which a keepalive query is sent on a session if the NS
+// did not announce its idle timeout
+#define NS_PING_IVL 5000
+// maximum number of retries of a query if the session to the NS breaks
+#define MAX_RETRY 1
+// the smoothed RTT of an upstream which got no answer during a housekeeping
+// interval is reduced by 1/2^RTT_DECAY, thus it is tried again eventually
+#define RTT_DECAY 2
+// number of buckets of the RTT histogram of an upstream, see rtt_bucket()
+#define RTT_HIST_SIZE 64
+// the counts of the RTT histogram are halved when their sum exceeds this
+#define RTT_HIST_MAX 1024
+// minimum number of RTT samples before queries to an upstream are hedged
+#define HEDGE_MIN_SAMPLES 32
+// default budget of hedged queries [% of the queries to the NS]
+#define HEDGE_BUDGET 5
+// maximum number of hedged queries which may be sent in a burst
+#define HEDGE_BURST 10
+// number of consecutive failures after which an upstream is taken out of
+// rotation (the circuit breaker opens)
+#define UP_MAX_FAILS 3
+// first and maximum interval [ms] between probes of an upstream which is down
+#define PROBE_MIN_IVL 1000
+#define PROBE_MAX_IVL 64000
+// timeout [s] of a probe query
+#define PROBE_TIMEOUT 2
+// maximum number of addresses of an upstream
+#define UP_MAX_ADDR 8
+// delay [ms] after which the next address of an upstream is tried in parallel
+// if a connection attempt does not succeed (RFC 8305)
+#define CONN_ATTEMPT_DELAY 250
 
-#define LOG_WARN LOG_WARNING
-#define FRAMESIZE 65536
 #define NOBODY 65534
+// maximum number of events returned by one call to epoll_wait()
+#define MAX_EVENTS 64
+// maximum number of iovecs used in a single writev()
+#define MAX_IOV 64
+// default and maximum number of datagrams received or sent with one call
+#define UDP_BATCH 32
+#define MAX_UDP_BATCH 1024
+// maximum size of a datagram received from a UDP client, answers from the
+// cache are built within the receive buffer thus it must not be smaller than
+// CACHE_MAX_MSG
+#define UDP_RX_SIZE 4096
+// size of the buffer for reading from sessions to the NS
+#define NS_RBUF_SIZE 16384
+// maximum number of replies waiting to be sent to UDP clients
+#define UDP_TXQ_SIZE 4096
+// maximum number of TCP client sessions per worker
+#define MAX_TCP_CLIENTS 256
+// idle time [s] after which a TCP client session without outstanding queries
+// is closed, it is announced with edns-tcp-keepalive (RFC 7828)
+#define TCP_IDLE_TIMEOUT 10
+// maximum number of connections accepted at once
+#define ACCEPT_BATCH 16
 
 #ifndef SOCK_NONBLOCK
 #define SOCK_NONBLOCK 0
@@ -74,25 +158,269 @@
 #define SET_NONBLOCK(x)
 #endif
 
+#if !defined(HAVE_RECVMMSG) || !defined(HAVE_SENDMMSG)
+struct mmsghdr
+{
+   struct msghdr msg_hdr;
+   unsigned int msg_len;
+};
+#endif
+
+
+// types of event sources registered with epoll
+enum {EV_UDP, EV_TCP_LISTEN, EV_NS, EV_NS_RACE, EV_TCP_CLIENT};
+
+/*! Every object which is registered with epoll starts with this structure.
+ * A pointer to it is stored in the data member of the epoll event thus the
+ * dispatcher knows what kind of object became ready.
+ */
+typedef struct ev_src
+{
+   int type;                        // type of event source (EV_xxx)
+   int fd;                          // file descriptor
+} ev_src_t;
+
+/*! Socket address of a client or an NS. The sockets are bound to AF_INET6 or
+ * AF_INET thus this is sufficient and much smaller than a sockaddr_storage.
+ */
+typedef union sock_addr
+{
+   struct sockaddr sa;
+   struct sockaddr_in sin;
+   struct sockaddr_in6 sin6;
+} sock_addr_t;
+
+/*! Receive state of a TCP stream of length-prefixed DNS messages. First the
+ * 2 byte length header is collected, then the message.
+ */
+typedef struct frame_rx
+{
+   int hdr_len;                     // number of bytes of length header received
+   uint8_t hdr[2];                  // length header of current frame
+   char *msg;                       // buffer of partially received frame
+   int msg_size;                    // size of msg
+   int msg_len;                     // number of bytes received into msg
+} frame_rx_t;
+
+struct ns_conn;
+struct cl_conn;
 
 typedef struct dns_trx
 {
-   struct sockaddr_storage addr;    // keep socket address of original UDP sender
+   sock_addr_t addr;                // keep socket address of original UDP sender
    socklen_t addr_len;
-   time_t time;                     // incoming timestamp
-   int dst_sock;                    // socket fd of outgoing TCP connection
-   int in_sock;                     // socket fd for incoming TCP connection
+   uint64_t time;                   // incoming timestamp [ms]
+   uint64_t sent;                   // time [ms] the query was queued to the NS
+   struct ns_conn *ns;              // TCP session to the NS the query is queued on
+   struct cl_conn *cl;              // TCP session of the client, NULL for UDP
+   struct dns_trx *hedge;           // hedge of the query, or query of a hedge
+   int is_hedge;                    // set if trx is the hedge of another one
+   struct upstream *probe;          // upstream checked by a probe, NULL otherwise
+   int ping;                        // set if trx keeps an idle session open
+   int keepalive;                   // set if the query has edns-tcp-keepalive
+   uint16_t id;                     // original message ID (network byte order)
+   int ns_id;                       // message ID on the session to the NS
+   struct dns_trx *next, *prev;     // list pointers within the queues of ns or cl
+   int retry;                       // number of retries
+   int cflags;                      // cache flags of query, -1 if not cacheable
+   int qlen;                        // length of question
+   uint32_t hash;                   // hash value of question
+   int inflight;                    // set if trx is in the in-flight table
+   struct dns_trx *hnext;           // next trx in chain of in-flight table
+   struct dns_trx *waiters;         // trx waiting for the same answer
+   struct dns_trx *leader;          // trx this one is waiting for
+   struct dns_trx *fnext;           // next trx in stack of free transactions
+   wtimer_t timer;                  // timeout of the transaction
    int conn_state;                  // state of transaction
    int data_len;                    // data length to send
-   char data[FRAMESIZE + 2];        // data
+   int data_size;                   // size of data buffer
+   char *data;                      // data buffer from the buffer pool
 } dns_trx_t;
 
+/*! A ring of pointers to transactions. */
+typedef struct trx_ring
+{
+   dns_trx_t **trx;                 // elements of the ring
+   int size;                        // number of elements
+   int head;                        // index of first element in use
+   int cnt;                         // number of elements in use
+} trx_ring_t;
+
+/*! A trx queue is a doubly linked list of transactions. */
+typedef struct trx_queue
+{
+   dns_trx_t *head, *tail;
+   int cnt;                         // number of elements in the queue
+} trx_queue_t;
 
-void log_msg(int, const char*, ...) __attribute__((format (printf, 2, 3)));
-FILE *init_log(const char*, int);
-
-
-enum {CONN_STATE_NA, CONN_STATE_SEND, CONN_STATE_RECV};
+/*! This structure keeps the state of a persistent TCP session to the NS.
+ * Queries of many transactions are pipelined on a single session (RFC 7766).
+ * The answers are matched to the transactions by the message ID.
+ */
+typedef struct ns_conn
+{
+   ev_src_t ev;                     // epoll source, must be first member
+   struct upstream *up;             // NS of the session
+   int ai;                          // index of the address of ev.fd
+   ev_src_t race;                   // parallel connection attempt, fd -1 if none
+   int race_ai;                     // index of the address of race.fd
+   int tried;                       // number of addresses tried to connect to
+   wtimer_t race_timer;             // starts the parallel connection attempt
+   int state;                       // session state (NS_STATE_xxx)
+   uint64_t time;                   // time of last activity [ms]
+   int flush;                       // set if send queue should be flushed
+   int reset;                       // set if the stream is broken, see cancel_query()
+   int ka_timeout;                  // idle timeout [100 ms] of the NS, -1 if unknown
+   trx_queue_t sendq;               // transactions waiting to be sent
+   int send_off;                    // bytes of sendq.head already sent
+   trx_queue_t waitq;               // transactions waiting for an answer
+   idmap_t idmap;                   // maps message IDs to transactions
+   frame_rx_t rx;                   // receive state of answers
+} ns_conn_t;
+
+/*! This structure keeps the state of an upstream NS within a worker. Every
+ * upstream has its own set of sessions. The smoothed RTT and the number of
+ * outstanding queries are used to select the NS for new queries. An NS may
+ * have several addresses, e.g. IPv6 and IPv4, sessions are opened to the one
+ * which connected fastest.
+ */
+typedef struct upstream
+{
+   const char *name;                // NS as given on the command line
+   sock_addr_t *addr;               // socket addresses of the NS
+   int addr_cnt;                    // number of addresses
+   int pref;                        // index of the preferred address
+   ns_conn_t *ns;                   // sessions to the NS
+   int ns_cnt;                      // number of sessions
+   int srtt;                        // smoothed RTT [1/8 ms], -1 if not measured
+   uint64_t last;                   // time [ms] of the last RTT sample
+   unsigned long queries;           // number of queries sent
+   unsigned long answers;           // number of answers received
+   unsigned long timeouts;          // number of queries which timed out
+   unsigned rtt_hist[RTT_HIST_SIZE]; // histogram of RTT samples
+   unsigned rtt_cnt;                // sum of rtt_hist
+   int p95;                         // 95th percentile of RTT [ms], -1 if unknown
+   int fails;                       // number of consecutive failures
+   int down;                        // set if the circuit breaker is open
+   int probing;                     // set while a probe is outstanding
+   int probe_ivl;                   // interval [ms] to the next probe
+   uint64_t probe_time;             // time [ms] of the next probe
+   unsigned long probes;            // number of probes sent
+} upstream_t;
+
+/*! This structure keeps the state of a TCP session of a client. The client
+ * may send many queries without waiting for the answers. Every query is a
+ * transaction of its own which refers to the session. The answers are queued
+ * in the order in which they complete. The structure is freed not before the
+ * session is closed and all of its transactions are released.
+ */
+typedef struct cl_conn
+{
+   ev_src_t ev;                     // epoll source, must be first member
+   sock_addr_t addr;                // socket address of the client
+   socklen_t addr_len;
+   int closed;                      // set if the socket was closed
+   int eof;                         // set if the client shut down its sending side
+   int refs;                        // number of transactions of the session
+   int flush;                       // set if the session is on the flush list
+   struct cl_conn *fnext;           // next session on the flush list
+   frame_rx_t rx;                   // receive state of queries
+   trx_queue_t sendq;               // answers waiting to be sent
+   int send_off;                    // bytes of sendq.head already sent
+   wtimer_t idle;                   // idle timeout of the session
+} cl_conn_t;
+
+/*! A batch of UDP datagrams which are received with recvmmsg() or sent with
+ * sendmmsg(). Every datagram belongs to a transaction.
+ */
+typedef struct udp_batch
+{
+   struct mmsghdr *msg;             // message headers
+   struct iovec *iov;               // one iovec per message
+   dns_trx_t **trx;                 // transaction of each message
+   char *buf;                       // receive buffers, UDP_RX_SIZE per message
+   int cnt;                         // number of messages in the batch
+} udp_batch_t;
+
+/*! Statistic counters of the dispatcher. */
+typedef struct dns_stats
+{
+   unsigned long rx_calls;          // number of calls to recvmmsg()
+   unsigned long rx_msgs;           // number of datagrams received
+   unsigned long tx_calls;          // number of calls to sendmmsg()
+   unsigned long tx_msgs;           // number of datagrams sent
+   unsigned long coalesced;         // number of queries attached to others
+   unsigned long paused;            // number of times input was paused
+   unsigned long tx_blocked;        // number of times the UDP socket blocked
+   unsigned long tx_dropped;        // number of replies dropped
+   unsigned long tcp_accepted;      // number of TCP client sessions accepted
+   unsigned long tcp_rejected;      // number of TCP client sessions rejected
+   unsigned long tcp_queries;       // number of queries received with TCP
+   unsigned long hedges;            // number of hedged queries sent
+   unsigned long hedges_won;        // number of hedges answered first
+   unsigned long hedges_limited;    // number of hedges suppressed by the budget
+} dns_stats_t;
+
+/*! The context of the dispatcher. Every worker thread has its own context,
+ * nothing of it is shared with other workers.
+ */
+typedef struct dns_ctx
+{
+   int id;                          // worker id
+#ifdef WITH_THREADS
+   pthread_t thread;                // thread of the worker
+#endif
+   int efd;                         // epoll file descriptor
+   int udp_sock;                    // UDP socket
+   int tcp_sock;                    // listening TCP socket
+   ev_src_t udp_src;                // epoll source of udp_sock
+   ev_src_t tcp_src;                // epoll source of tcp_sock
+   int input_paused;                // set if reading from the sockets is disabled
+   dns_trx_t **trx_chunk;           // transaction table, allocated in chunks
+   int chunk_cnt;                   // number of chunks in trx_chunk
+   int trx_cnt;                     // number of allocated transactions
+   int max_trx;                     // maximum number of transactions
+   int timeout;                     // timeout [s] of transactions
+   dns_trx_t *free_trx;             // stack of unused transactions
+   int active_cnt;                  // number of transactions in use
+   dns_trx_t **inflight;            // hash table of outstanding queries
+   unsigned inflight_mask;          // number of buckets of inflight - 1
+   upstream_t *up;                  // upstream name servers
+   int up_cnt;                      // number of upstreams
+   uint32_t rnd;                    // state of the random number generator
+   int hedge_pct;                   // budget of hedged queries [%], 0 disables hedging
+   int hedge_credit;                // remaining budget [1/100 hedges]
+   ns_conn_t *ns;                   // sessions to all upstreams
+   int ns_cnt;                      // number of entries in ns
+   int min_conn;                    // minimum number of open sessions to each upstream
+   char *ns_rbuf;                   // read buffer of all TCP sessions, NS_RBUF_SIZE
+   int cl_cnt;                      // number of open TCP client sessions
+   cl_conn_t *cl_flush;             // client sessions with pending answers
+   int batch;                       // maximum number of datagrams per batch
+   udp_batch_t rx;                  // batch of incoming datagrams
+   udp_batch_t tx;                  // batch of outgoing datagrams
+   trx_ring_t txq;                  // replies waiting to be sent
+   int tx_blocked;                  // set if the UDP socket is polled for writing
+   dns_stats_t stats;               // statistic counters
+   buf_pool_t pool;                 // message buffers of the transactions
+   int cache_size;                  // maximum number of cache entries
+   dns_cache_t cache;               // response cache
+   int stats_gen;                   // value of sig_stats_ when stats were logged
+   twheel_t timers;                 // timer wheel
+   wtimer_t housekeeping;           // periodic housekeeping timer
+   spsc_t *tap;                     // ring of the dnstap log, NULL if disabled
+} dns_ctx_t;
+
+
+enum {CONN_STATE_NA, CONN_STATE_NEW, CONN_STATE_SEND, CONN_STATE_RECV, CONN_STATE_REPLY, CONN_STATE_WAIT};
+enum {NS_STATE_CLOSED, NS_STATE_CONNECTING, NS_STATE_CONNECTED};
+
+//! incremented by SIGUSR1 to request logging of the statistic counters
+static volatile sig_atomic_t sig_stats_ = 0;
+#ifdef WITH_THREADS
+//! worker id of the current thread
+static __thread int thread_id_ = 0;
+#endif
 
 
 /*! This function decodes the RR type and returns a constant string pointer.
@@ -131,89 +459,56 @@ static const char *dns_rcode(int code)
 }
 
 
-/*! Dns_label_to_buf() converts one label of a domain name to a \0-terminated C
- *  character string. Compressed labels (0xc0) are not decompressed but binary
- *  labels (0x40) are decoded. Thus the character string buf may contain \0
- *  bytes. buf will always be \0-terminated.
- *  @param src Pointer to DNS label.
- *  @param buf Pointer to destination buffer.
- *  @param len Total length of buf.
- *  @return Number of bytes copied to buf excluding the terminating \0. Thus,
- *  the total number of bytes copied to buf is always less than len.
- */
-static int dns_label_to_buf(const char *src, char *buf, int len)
+#ifdef USE_FCNTL
+static int set_nonblock(int s)
 {
-   int i = 0, llen;
-
-   len--;
-   llen = *src++ & 0xff;
-   // uncompressed label
-   if (!(llen & 0xc0))
-   {
-      for (; i < llen && len > 0; i++, src++, len--, buf++)
-         *buf = *src;
-   }
-   // compressed label
-   else if ((llen & 0xc0) == 0xc0)
-   {
-      if (len > 0)
-      {
-         *buf++ = '_';
-         i++;
-         len--;
-      }
-   }
-   // binary label, EDNS0
-   else if ((llen & 0xc0) == 0x40)
+   if (fcntl(s, F_SETFL, O_NONBLOCK) == -1)
    {
-      llen = *src & 0xff;
-      //*buf++ = *src++;
-      if (!llen) len = 256;
-      llen--;
-      llen >>= 3;
-      llen++;
-      for (; i <= llen && len > 0; i++, src++, len--, buf++)
-         *buf = *src;
+      log_msg(LOG_ERR, "fcntl() failed: %s", strerror(errno));
+      return -1;
    }
-   *buf = '\0';
-   return i;
+   return 0;
 }
+#endif
 
 
-/*! Decodes a domain name consisting of several DNS labels.
- *  @param src Pointer to domain name.
- *  @param buf Pointer to destination buffer.
- *  @param len Total length of buf.
- *  @return The total number of bytes within buf including the terminating \0
- *  which is also the total number of bytes decoded within src.
+#ifndef HAVE_RECVMMSG
+/*! Replacement for recvmmsg() on systems which do not have it. It receives
+ *  datagrams one by one until vlen datagrams are received or the socket would
+ *  block.
  */
-static int dns_name_to_buf(const char *src, char *buf, int len)
+static int recvmmsg(int fd, struct mmsghdr *msg, unsigned vlen, int flags, struct timespec *timeout)
 {
-   int llen, nlen;
+   unsigned i;
+   int len;
 
-   for (nlen = 0;;src += llen + 1)
+   (void) timeout;
+   for (i = 0; i < vlen; i++)
    {
-      if (!(llen = dns_label_to_buf(src, buf, len)))
-         break;
-      buf += llen;
-      *buf = '.';
-      buf++;
-      len -= llen + 1;
-      nlen += llen + 1;
+      if ((len = recvmsg(fd, &msg[i].msg_hdr, flags)) == -1)
+         return i ? (int) i : -1;
+      msg[i].msg_len = len;
    }
-   return nlen + 1;
+   return i;
 }
+#endif
 
 
-#ifdef USE_FCNTL
-static int set_nonblock(int s)
+#ifndef HAVE_SENDMMSG
+/*! Replacement for sendmmsg() on systems which do not have it.
+ */
+static int sendmmsg(int fd, struct mmsghdr *msg, unsigned vlen, int flags)
 {
-   if (fcntl(s, F_SETFL, O_NONBLOCK) == -1)
+   unsigned i;
+   int len;
+
+   for (i = 0; i < vlen; i++)
    {
-      log_msg(LOG_ERR, "fcntl() failed: %s", strerror(errno));
-      return -1;
+      if ((len = sendmsg(fd, &msg[i].msg_hdr, flags)) == -1)
+         return i ? (int) i : -1;
+      msg[i].msg_len = len;
    }
-   return 0;
+   return i;
 }
 #endif
 
@@ -221,13 +516,16 @@ static int set_nonblock(int s)
 /*! This function opens a UDP socket on all addresses (0.0.0.0 and ::) of the
  * host at the given port number.
  * @param port Port number for the UDP socket.
+ * @param reuse If not 0, SO_REUSEPORT is set on the socket thus several
+ * sockets may be bound to the same port. The kernel distributes the incoming
+ * packets (or connections) between them.
  * @return Returns a valid file descriptor of the socket or -1 in case of
  * error.
  */
-static int init_srv_socket(int family, int type, int port)
+static int init_srv_socket(int family, int type, int port, int reuse)
 {
    struct sockaddr_storage sock_addr;
-   int sock, len;
+   int sock, len, on = 1;
 
    memset(&sock_addr, 0, sizeof(sock_addr));
    sock_addr.ss_family = family;
@@ -257,6 +555,26 @@ static int init_srv_socket(int family, int type, int port)
 
    SET_NONBLOCK(sock);
 
+   // sessions of clients in TIME_WAIT must not prevent a restart
+   if (type == SOCK_STREAM && setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) == -1)
+      log_msg(LOG_WARN, "setsockopt(SO_REUSEADDR) failed: %s", strerror(errno));
+
+   if (reuse)
+   {
+#ifdef SO_REUSEPORT
+      if (setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) == -1)
+      {
+         log_msg(LOG_ERR, "setsockopt(SO_REUSEPORT) failed: %s", strerror(errno));
+         (void) close(sock);
+         return -1;
+      }
+#else
+      log_msg(LOG_ERR, "SO_REUSEPORT not supported on this system");
+      (void) close(sock);
+      return -1;
+#endif
+   }
+
    if (bind(sock, (struct sockaddr*) &sock_addr, len) == -1)
    {
       log_msg(LOG_ERR, "binding udp socket failed: %s", strerror(errno));
@@ -268,11 +586,11 @@ static int init_srv_socket(int family, int type, int port)
 }
 
 
-static int init_tcp_socket(int family, int port)
+static int init_tcp_socket(int family, int port, int reuse)
 {
    int s;
    
-   if ((s = init_srv_socket(family, SOCK_STREAM, port)) == -1)
+   if ((s = init_srv_socket(family, SOCK_STREAM, port, reuse)) == -1)
       return -1;
 
    if (listen(s, 10) == -1)
@@ -286,361 +604,2741 @@ static int init_tcp_socket(int family, int port)
 }
 
 
-static int init_udp_socket(int family, int port)
+static int init_udp_socket(int family, int port, int reuse)
+{
+   return init_srv_socket(family, SOCK_DGRAM, port, reuse);
+}
+
+
+/*! Format an IPv4 address in dotted notation.
+ *  @param p Pointer to the destination buffer of at least INET_ADDRSTRLEN
+ *  bytes.
+ *  @param a Pointer to the 4 bytes of the address.
+ */
+static void ip4_str(char *p, const unsigned char *a)
+{
+   int i, v;
+
+   for (i = 0; i < 4; i++)
+   {
+      v = a[i];
+      if (v >= 100)
+         *p++ = '0' + v / 100;
+      if (v >= 10)
+         *p++ = '0' + v / 10 % 10;
+      *p++ = '0' + v % 10;
+      *p++ = i < 3 ? '.' : '\0';
+   }
+}
+
+
+/*! Convert the IP address of a socket address to a string. IPv4 addresses
+ *  (also if mapped to IPv6) are formatted directly, other IPv6 addresses
+ *  with inet_ntop(). Unlike getnameinfo() this never involves the resolver.
+ *  @param sa Pointer to the socket address.
+ *  @param buf Pointer to the destination buffer of at least
+ *  INET6_ADDRSTRLEN bytes.
+ *  @return Returns buf.
+ */
+static const char *addr_str(const struct sockaddr *sa, char *buf)
 {
-   return init_srv_socket(family, SOCK_DGRAM, port);
+   const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6*) sa;
+
+   if (sa->sa_family == AF_INET)
+      ip4_str(buf, (const unsigned char*) &((const struct sockaddr_in*) sa)->sin_addr);
+   else if (sa->sa_family != AF_INET6)
+      strcpy(buf, "(unknown)");
+   else if (IN6_IS_ADDR_V4MAPPED(&sin6->sin6_addr))
+   {
+      memcpy(buf, "::ffff:", 7);
+      ip4_str(buf + 7, &sin6->sin6_addr.s6_addr[12]);
+   }
+   else if (inet_ntop(AF_INET6, &sin6->sin6_addr, buf, INET6_ADDRSTRLEN) == NULL)
+      strcpy(buf, "(invalid)");
+   return buf;
 }
 
 
 /*! Simple logging function which outputs some information about a (newly
  * created) DNS transaction.
  * @param dt Pointer to the transaction.
+ * @param q Pointer to the parsed query.
  */
-static void log_udp_in(const dns_trx_t *dt)
+static void log_query_in(const dns_trx_t *dt, const dns_query_t *q)
 {
-   char buf[64], name[256];
-   int len, qtype;
+   char buf[INET6_ADDRSTRLEN], name[DNS_NAME_SIZE];
 
-   if (getnameinfo((struct sockaddr*) &dt->addr, dt->addr_len, buf, sizeof(buf), NULL, 0, NI_NUMERICHOST))
+   // this is called for every query, skip the formatting if it is not logged
+   if (!log_enabled(LOG_INFO))
       return;
 
-   len = dns_name_to_buf(dt->data + 14, name, sizeof(name));
-   qtype = ntohs(*((int16_t*) (dt->data + 14 + len)));
-   log_msg(LOG_INFO, "%d bytes incoming from %s, id = 0x%04x, '%s'/%s", dt->data_len, buf, 
-         (int) ntohs(*((int16_t*) (dt->data + 2))), name, dns_rr_type(qtype));
+   if (dns_name_str(dt->data + 2, dt->data_len - 2, DNS_HDR_LEN, name, sizeof(name)) == -1)
+      strcpy(name, "(invalid)");
+   log_msg(LOG_INFO, "%d bytes incoming on %s from %s, id = 0x%04x, '%s'/%s", dt->data_len - 2, dt->cl != NULL ? "tcp" : "udp",
+         addr_str((struct sockaddr*) &dt->addr, buf), (int) ntohs(*((int16_t*) (dt->data + 2))), name, dns_rr_type(q->qtype));
 }
 
 
-/*! Asynchronously (non-blocking) open a TCP session to a given destination.
- *  @param dns_addr Destinationa address.
- *  @param addr_len Length of dns_addr structure.
- *  @return Returns a valid file descriptor of the socket being in connection
- *  setup or -1 in case of error.
+/*! Write a message of a transaction to the dnstap log. The time of the
+ *  query is derived from the receive time of the transaction.
+ *  @param ctx Pointer to the dispatcher context.
+ *  @param trx Pointer to the transaction.
+ *  @param type Message type (DNSTAP_xxx).
+ *  @param msg Pointer to the DNS message.
+ *  @param len Length of the message.
  */
-static int connect_to_dns_server(const struct sockaddr *dns_addr, socklen_t addr_len)
+static void tap_trx(const dns_ctx_t *ctx, const dns_trx_t *trx, int type, const char *msg, int len)
 {
-   int sock;
+   struct timeval now, qt;
+   uint64_t age;
+
+   if (ctx->tap == NULL)
+      return;
 
-   if ((sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) == -1)
+   clock_wall(&now);
+   age = (clock_ms() - trx->time) * 1000;
+   qt.tv_sec = now.tv_sec - age / 1000000;
+   qt.tv_usec = now.tv_usec - age % 1000000;
+   if (qt.tv_usec < 0)
    {
-      log_msg(LOG_ERR, "creating tcp socket for NS connection failed: %s", strerror(errno));
-      return -1;
+      qt.tv_usec += 1000000;
+      qt.tv_sec--;
    }
 
-   SET_NONBLOCK(sock);
-
-   if (connect(sock, dns_addr, addr_len) == -1 &&
-         errno != EINPROGRESS)
+   switch (type)
    {
-      log_msg(LOG_ERR, "async connect to NS connection failed: %s", strerror(errno));
-      (void) close(sock);
-      return -1;
+      case DNSTAP_CLIENT_QUERY:
+         dnstap_log(ctx->tap, type, trx->cl != NULL, (struct sockaddr*) &trx->addr, &now, NULL, msg, len);
+         break;
+      case DNSTAP_CLIENT_RESPONSE:
+         dnstap_log(ctx->tap, type, trx->cl != NULL, (struct sockaddr*) &trx->addr, &qt, &now, msg, len);
+         break;
+      // the NS is always queried with TCP
+      case DNSTAP_FORWARDER_QUERY:
+         dnstap_log(ctx->tap, type, 1, &trx->ns->up->addr[trx->ns->ai].sa, &now, NULL, msg, len);
+         break;
+      case DNSTAP_FORWARDER_RESPONSE:
+         dnstap_log(ctx->tap, type, 1, &trx->ns->up->addr[trx->ns->ai].sa, &qt, &now, msg, len);
+         break;
    }
-
-   log_msg(LOG_DEBUG, "connecting %d to NS", sock);
-   return sock;
 }
 
 
-/*! Send data to remote NS on an open TCP session.
- *  @param trx Pointer to DNS transaction structure containing the data.
- *  @return Returns the number of bytes sent. The function can be called
- *  several times until the whole data buffer is empty. If all bytes could be
- *  sent the connection state of the transaction (trx->conn_state) is changed
- *  to CONN_STATE_RECV.
+/*! Append a transaction to the tail of a queue.
+ *  @param q Pointer to the queue.
+ *  @param trx Pointer to the transaction.
  */
-static int send_to_dns(dns_trx_t *trx)
+static void trxq_append(trx_queue_t *q, dns_trx_t *trx)
 {
-   int len;
+   trx->next = NULL;
+   trx->prev = q->tail;
+   if (q->tail != NULL)
+      q->tail->next = trx;
+   else
+      q->head = trx;
+   q->tail = trx;
+   q->cnt++;
+}
 
-   if ((len = send(trx->dst_sock, trx->data, trx->data_len, 0)) == -1)
-   {
-      log_msg(LOG_ERR, "sending data on %d to NS failed: %s", trx->dst_sock, strerror(errno));
-      return -1;
-   }
-   log_msg(LOG_DEBUG, "sending data to NS on %d", trx->dst_sock);
-   
-   if (len < trx->data_len)
-   {
-      // FIXME: LOG_WARN?
-      log_msg(LOG_WARN, "tcp send truncated: sent %d/%d", len, trx->data_len);
-      memmove(trx->data, trx->data + len, trx->data_len - len);
-   }
-   // if all data was sent bump state to RECV
+
+/*! Remove a transaction from a queue.
+ *  @param q Pointer to the queue.
+ *  @param trx Pointer to the transaction which must be an element of q.
+ */
+static void trxq_remove(trx_queue_t *q, dns_trx_t *trx)
+{
+   if (trx->prev != NULL)
+      trx->prev->next = trx->next;
    else
-      trx->conn_state = CONN_STATE_RECV;
-   trx->data_len -= len;
-   return len;
+      q->head = trx->next;
+   if (trx->next != NULL)
+      trx->next->prev = trx->prev;
+   else
+      q->tail = trx->prev;
+   trx->next = trx->prev = NULL;
+   q->cnt--;
 }
 
 
-/*! Get_free_trx() looks up and returns a pointer to a currently unused
- *  transaction structure within the table of transactions.
- *  @param trx Pointer to the beginning of the transaction table.
- *  @param trx_cnt Number of entries in the table.
- *  @return Returns a valid pointer or NULL of no entry is available. The
- *  connection state of an empty transaction is initialized to CONN_STATE_NA
- *  and the destination (TCP) file descriptor contains a value of less than or
- *  equal to 0.
+/*! Return the length of a socket address.
  */
-static dns_trx_t *get_free_trx(dns_trx_t *trx, int trx_cnt)
+static socklen_t sa_len(const sock_addr_t *addr)
 {
-   for (; trx_cnt; trx_cnt--, trx++)
-      if (trx->dst_sock <= 0)
-      {
-         trx->conn_state = CONN_STATE_NA;
-         return trx;
-      }
-   return NULL;
+   return addr->sa.sa_family == AF_INET6 ? sizeof(addr->sin6) : sizeof(addr->sin);
 }
 
 
-/*! This is the main routing for dispatching packets between UDP clients and
- * the TCP name server. It keeps track on all transactions within the
- * transaction table. Stale transactions will be removed not before the timeout
- * (TIMEOUT) elapses.
- * @param udp_sock File descriptor of UDP socket used for receiving packets of
- * the clients.
- * @param trx Pointer to the beginning of the transaction table.
- * @param trx_cnt Number of maximum entries in trx.
- * @param dns_addr Pointer to the socket address of the remote NS.
- * @param addr_len Length of the dns_addr structure.
- * @return -1 in case of error.
+/*! Return the port number of a socket address.
  */
-static int dispatch_packets(int udp_sock, int tcp_sock, dns_trx_t *trx, int trx_cnt, const struct sockaddr *dns_addr, socklen_t addr_len)
+static int sa_port(const sock_addr_t *addr)
 {
-   int i, nfds, len, so_err, running = 1;
-   socklen_t so_err_len;
-   fd_set rset, wset;
-   dns_trx_t *inp;
-   time_t curr;
+   return ntohs(addr->sa.sa_family == AF_INET6 ? addr->sin6.sin6_port : addr->sin.sin_port);
+}
 
-   while (running)
+
+/*! Asynchronously (non-blocking) start a connection attempt to an address of
+ *  the NS. The socket is registered with epoll once for both directions
+ *  (edge-triggered). Thus it is reported as writable as soon as the connection
+ *  is established and as readable when data arrives.
+ *  @param ctx Pointer to the dispatcher context.
+ *  @param ns Pointer to the session.
+ *  @param src Epoll source of the attempt, either &ns->ev or &ns->race.
+ *  @param ai Index of the address within the addresses of the upstream.
+ *  @return Returns a valid file descriptor of the socket being in connection
+ *  setup or -1 in case of error.
+ */
+static int ns_attempt(dns_ctx_t *ctx, ns_conn_t *ns, ev_src_t *src, int ai)
+{
+   const sock_addr_t *addr = &ns->up->addr[ai];
+   char buf[INET6_ADDRSTRLEN];
+   struct epoll_event ev;
+   int sock, on = 1;
+
+   if ((sock = socket(addr->sa.sa_family, SOCK_STREAM | SOCK_NONBLOCK, 0)) == -1)
    {
-      FD_ZERO(&rset);
-      FD_ZERO(&wset);
+      log_msg(LOG_ERR, "creating tcp socket for NS connection failed: %s", strerror(errno));
+      return -1;
+   }
 
-      // wait on udp socket for input packets
-      FD_SET(udp_sock, &rset);
-      FD_SET(tcp_sock, &rset);
-      nfds = udp_sock > tcp_sock ? udp_sock : tcp_sock;
+   SET_NONBLOCK(sock);
 
-      curr = time(NULL);
-      for (i = 0, len = 1; i < trx_cnt; i++)
-      {
-         // FIXME: an 'active' trx counter would improve execution speed
-         if (trx[i].dst_sock <= 0)
-            continue;
+   // queries are pipelined, don't let Nagle delay them
+   if (setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) == -1)
+      log_msg(LOG_WARN, "setsockopt(%d, TCP_NODELAY) failed: %s", sock, strerror(errno));
 
-         if (trx[i].time < curr - TIMEOUT)
-         {
-            log_msg(LOG_NOTICE, "removing stale socket %d", trx[i].dst_sock);
-            (void) close(trx[i].dst_sock);
-            trx[i].dst_sock = 0;
-            continue;
-         }
+   if (connect(sock, &addr->sa, sa_len(addr)) == -1 &&
+         errno != EINPROGRESS)
+   {
+      log_msg(LOG_ERR, "async connect to upstream %s via %s port %d failed: %s", ns->up->name, addr_str(&addr->sa, buf),
+            sa_port(addr), strerror(errno));
+      (void) close(sock);
+      return -1;
+   }
 
-         // data is waiting for sending to NS
-         if (trx[i].conn_state == CONN_STATE_SEND)
-         {
-            log_msg(LOG_DEBUG, "adding %d to wset", trx[i].dst_sock);
-            FD_SET(trx[i].dst_sock, &wset);
-            len++;
-         }
-         // tcp is ready for reading from NS
-         else if (trx[i].conn_state == CONN_STATE_RECV)
-         {
-            log_msg(LOG_DEBUG, "adding %d to rset", trx[i].dst_sock);
-            FD_SET(trx[i].dst_sock, &rset);
-            len++;
-         }
-         else
-         {
-            log_msg(LOG_EMERG, "this should not happen: conn_state = %d", trx[i].conn_state);
-            continue;
-         }
+   ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+   ev.data.ptr = src;
+   if (epoll_ctl(ctx->efd, EPOLL_CTL_ADD, sock, &ev) == -1)
+   {
+      log_msg(LOG_ERR, "epoll_ctl(%d) failed: %s", sock, strerror(errno));
+      (void) close(sock);
+      return -1;
+   }
+
+   src->fd = sock;
+   if (src == &ns->ev)
+      ns->ai = ai;
+   else
+      ns->race_ai = ai;
+
+   log_msg(LOG_DEBUG, "connecting %d to NS %s", sock, addr_str(&addr->sa, buf));
+   return sock;
+}
 
-         if (nfds < trx[i].dst_sock)
-            nfds = trx[i].dst_sock;
-      } // for (i = 0, len = 0; i < trx_cnt; i++)
 
-      log_msg(LOG_DEBUG, "select()ing on %d sockets", len);
-      if ((nfds = select(nfds + 1, &rset, &wset, NULL, NULL)) == -1)
+/*! Start a connection attempt to the next address of the NS which was not
+ *  tried yet. The addresses are tried beginning with the preferred one. If
+ *  there are more addresses, the next one is tried in parallel after
+ *  CONN_ATTEMPT_DELAY unless the session is established meanwhile (happy
+ *  eyeballs, RFC 8305).
+ *  @param ctx Pointer to the dispatcher context.
+ *  @param ns Pointer to the session.
+ *  @param src Epoll source of the attempt, either &ns->ev or &ns->race.
+ *  @return Returns 0 if an attempt was started or -1 if no address is left.
+ */
+static int ns_next_attempt(dns_ctx_t *ctx, ns_conn_t *ns, ev_src_t *src)
+{
+   upstream_t *up = ns->up;
+
+   while (ns->tried < up->addr_cnt)
+      if (ns_attempt(ctx, ns, src, (up->pref + ns->tried++) % up->addr_cnt) != -1)
       {
-         log_msg(LOG_ERR, "select() failed: %s", strerror(errno));
-         return -1;
+         if (ns->tried < up->addr_cnt)
+            tw_add(&ctx->timers, &ns->race_timer, clock_ms() + CONN_ATTEMPT_DELAY);
+         return 0;
       }
-      log_msg(LOG_DEBUG, "%d sockets ready", nfds);
+   return -1;
+}
 
-      // test for incoming packet on udp
-      if (FD_ISSET(udp_sock, &rset))
-      {
-         nfds--;
-         if ((inp = get_free_trx(trx, trx_cnt)) == NULL)
-         {
-            log_msg(LOG_WARN, "no free trx in table, retrying immediately");
-         }
-         else
-         {
-            inp->addr_len = sizeof(inp->addr);
-            if ((inp->data_len = recvfrom(udp_sock, &inp->data[2], sizeof(inp->data) - 2, 0,
-                     (struct sockaddr*) &inp->addr, &inp->addr_len)) == -1)
-            {
-               log_msg(LOG_ERR, "recvfrom() on udp socket failed: %s", strerror(errno));
-               return -1;
-            }
 
-            if (inp->data_len >= 12)
-            {
-               // FIXME: it should be checked if there is at least 1 question
-               log_udp_in(inp);
-               if ((inp->dst_sock = connect_to_dns_server(dns_addr, addr_len)) == -1)
-               {
-                  log_msg(LOG_WARN, "dropping request");
-                  inp->data_len = 0;
-               }
-               else
-               {
-                  inp->conn_state = CONN_STATE_SEND;
-                  // set length header for DNS/TCP
-                  *((uint16_t*) &inp->data[0]) = htons(inp->data_len);
-                  inp->data_len += 2;
-                  inp->time = time(NULL);
-               }
-            }
-            else
-               log_msg(LOG_WARN, "ignoring short datagram (len = %d)", inp->data_len);
-         }
-      } // if (FD_ISSET(udp_sock, &rset))
-      
-      // check if new incoming tcp session
-      if (FD_ISSET(tcp_sock, &rset))
-      {
-         nfds--;
-         if ((inp = get_free_trx(trx, trx_cnt)) == NULL)
-         {
-            log_msg(LOG_WARN, "no free trx in table, retrying immediately");
-         }
-         else
-         {
-            if ((inp->in_sock = accept(tcp_sock, (struct sockaddr*) &inp->addr, &inp->addr_len)) == -1)
-               log_msg(LOG_ERR, "accept(%d) failed: %s", tcp_sock, strerror(errno));
+/*! Timer callback which starts a parallel connection attempt if the session
+ *  is not established yet.
+ *  @param p Pointer to the dispatcher context.
+ *  @param data Pointer to the session.
+ */
+static void ns_race(void *p, void *data)
+{
+   ns_conn_t *ns = data;
 
-            log_msg(LOG_INFO, "accepted new session on %d", inp->in_sock);
-            // FIXME: incoming tcp not finished!
-         }
-      } // if (FD_ISSET(tcp_sock, &rset))
+   if (ns->state == NS_STATE_CONNECTING && ns->race.fd == -1)
+      (void) ns_next_attempt(p, ns, &ns->race);
+}
 
-      // test for incoming data on tcp
-      for (i = 0; nfds > 0 && i < trx_cnt; i++)
-      {
-         if (trx[i].dst_sock <= 0)
-            continue;
 
-         // incomming data on tcp socket
-         if (FD_ISSET(trx[i].dst_sock, &rset))
-         {
-            nfds--;
-            if ((len = recv(trx[i].dst_sock, trx[i].data + trx[i].data_len, sizeof(trx[i].data) - trx[i].data_len, 0)) == -1)
-            {
-               log_msg(LOG_ERR, "failed to recv() on tcp socket %d: %s. Dropping", trx[i].dst_sock, strerror(errno));
-               (void) close(trx[i].dst_sock);
-               trx[i].dst_sock = 0;
-               continue;
-            }
+/*! Let the parallel connection attempt take over the session. The other
+ *  attempt is closed.
+ *  @param ctx Pointer to the dispatcher context.
+ *  @param ns Pointer to the session.
+ */
+static void ns_adopt_race(dns_ctx_t *ctx, ns_conn_t *ns)
+{
+   struct epoll_event ev;
+
+   if (ns->ev.fd != -1)
+      (void) close(ns->ev.fd);
+   ns->ev.fd = ns->race.fd;
+   ns->ai = ns->race_ai;
+   ns->race.fd = -1;
+
+   // epoll reports the socket again if it is ready already
+   ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+   ev.data.ptr = ns;
+   if (epoll_ctl(ctx->efd, EPOLL_CTL_MOD, ns->ev.fd, &ev) == -1)
+      log_msg(LOG_ERR, "epoll_ctl(%d) failed: %s", ns->ev.fd, strerror(errno));
+}
 
-            trx[i].data_len += len;
-            log_msg(LOG_DEBUG, "received %d bytes on tcp socket %d", len, trx[i].dst_sock);
 
-            if (trx[i].data_len - 2 == ntohs(*((uint16_t*) &trx[i].data[0])))
-            {
-               trx[i].data_len -= 2;
-               (void) close(trx[i].dst_sock);
-               trx[i].dst_sock = 0;
-
-               // FIXME: this should be implemented asynchronous as well
-               if ((len = sendto(udp_sock, &trx[i].data[2], trx[i].data_len, 0,
-                     (struct sockaddr*) &trx[i].addr, trx[i].addr_len)) == -1)
-               {
-                  log_msg(LOG_ERR, "sendto() on udp failed: %s. dropping data", strerror(errno));
-               }
-               else
-               {
-                  log_msg(LOG_INFO, "replied %d/%d bytes on udp, id = 0x%04x, RCODE = %s", len, trx[i].data_len,
-                        (int) ntohs(*((int16_t*) (trx[i].data + 2))), dns_rcode(trx[i].data[5] & 15));
-               }
-               trx[i].data_len = 0;
-            }
-            else
-            {
-               // FIXME: handle better
-               log_msg(LOG_NOTICE, "received truncated packet on tcp %d. expect %d got %d, waiting",
-                     trx[i].dst_sock, trx[i].data_len, (int) ntohs(*((uint16_t*) &trx[i].data[0])));
-            }
-         } // if (FD_ISSET(trx[i].dst_sock, &rset))
+/*! Handle a failed connection attempt of a session. The next address is
+ *  tried. If there is none left, a parallel attempt which is still in
+ *  progress takes over.
+ *  @param ctx Pointer to the dispatcher context.
+ *  @param ns Pointer to the session.
+ *  @param src Epoll source of the failed attempt.
+ *  @return Returns 0 if the session is still connecting or -1 if all
+ *  attempts failed.
+ */
+static int ns_attempt_failed(dns_ctx_t *ctx, ns_conn_t *ns, ev_src_t *src)
+{
+   (void) close(src->fd);
+   src->fd = -1;
 
-         // tcp socket is ready for sending
-         if (FD_ISSET(trx[i].dst_sock, &wset))
-         {
-            nfds--;
-            so_err_len = sizeof(so_err);
-            if (getsockopt(trx[i].dst_sock, SOL_SOCKET, SO_ERROR, &so_err, &so_err_len) == -1)
-            {
-               log_msg(LOG_ERR, "getsockopt on %d failed: %s. closing.", trx[i].dst_sock, strerror(errno));
-               (void) close(trx[i].dst_sock);
-               trx[i].dst_sock = 0;
-            }
-            else if (so_err)
-            {
-               log_msg(LOG_ERR, "could not connect to NS: SO_ERROR = %d. closing.", so_err);
-               (void) close(trx[i].dst_sock);
-               trx[i].dst_sock = 0;
-            }
-            else
-            {
-               log_msg(LOG_DEBUG, "socket %d connected", trx[i].dst_sock);
-               if (send_to_dns(&trx[i]) == -1)
-               {
-                  log_msg(LOG_ERR, "dropping data and closing %d", trx[i].dst_sock);
-                  (void) close(trx[i].dst_sock);
-                  trx[i].dst_sock = 0;
-               }
-            }
-         } //if (FD_ISSET(trx[i].dst_sock, &wset))
-      }
-   }
+   if (ns_next_attempt(ctx, ns, src) == 0 || src == &ns->race)
+      return 0;
+   if (ns->race.fd == -1)
+      return -1;
+   ns_adopt_race(ctx, ns);
    return 0;
 }
 
 
+static void ping_ns(dns_ctx_t *ctx, ns_conn_t *ns);
 
-//#define TEST_UTDNS_FUNC
-#ifdef TEST_UTDNS_FUNC
-void test_utdns_func(void)
+/*! Handle a successful connection attempt of a session. A parallel attempt
+ *  is closed. The address of the faster attempt becomes the preferred one of
+ *  the upstream, thus the following sessions try it first. A keepalive query
+ *  is sent to learn the idle timeout of the NS, see ping_ns().
+ *  @param ctx Pointer to the dispatcher context.
+ *  @param ns Pointer to the session.
+ *  @param src Epoll source of the attempt.
+ */
+static void ns_connected(dns_ctx_t *ctx, ns_conn_t *ns, ev_src_t *src)
 {
-   char testar[] = {0x41, 24, 'a', 'b', 'c', 0xc0, 'A', 3, 'd', 'e', 'f', 0};
-   char buf[256];
+   char buf[INET6_ADDRSTRLEN];
 
-   dns_name_to_buf(testar, buf, sizeof(buf));
-   printf("%s\n", buf);
-   exit(0);
+   if (src == &ns->race)
+      ns_adopt_race(ctx, ns);
+   else if (ns->race.fd != -1)
+   {
+      (void) close(ns->race.fd);
+      ns->race.fd = -1;
+   }
+   tw_del(&ctx->timers, &ns->race_timer);
+
+   log_msg(LOG_DEBUG, "socket %d connected", ns->ev.fd);
+   ns->state = NS_STATE_CONNECTED;
+   if (ns->ai != ns->up->pref)
+   {
+      log_msg(LOG_INFO, "upstream %s: preferring %s", ns->up->name, addr_str(&ns->up->addr[ns->ai].sa, buf));
+      ns->up->pref = ns->ai;
+   }
+   // the idle timeout of the NS is needed to keep the session open
+   ping_ns(ctx, ns);
 }
-#endif
 
 
-static void background(void)
+/*! Asynchronously (non-blocking) open a TCP session to the NS, see
+ *  ns_next_attempt().
+ *  @param ctx Pointer to the dispatcher context.
+ *  @param ns Pointer to an unused session structure.
+ *  @return Returns a valid file descriptor of the socket being in connection
+ *  setup or -1 in case of error.
+ */
+static int connect_to_dns_server(dns_ctx_t *ctx, ns_conn_t *ns)
 {
-   pid_t pid, ppid;
+   // the ID map is kept for the lifetime of the session slot
+   if (ns->idmap.slot == NULL && idmap_init(&ns->idmap) == -1)
+      return -1;
 
-   log_msg(LOG_DEBUG, "backgrounding");
+   ns->tried = 0;
+   ns->race.fd = -1;
+   if (ns_next_attempt(ctx, ns, &ns->ev) == -1)
+      return -1;
 
-   ppid = getpid();
-   pid = fork();
-   switch(pid)
-   {
-      case -1:
-         log_msg(LOG_ERR, "fork failed: %s. Staying in foreground", strerror(errno));
-         return;
+   ns->state = NS_STATE_CONNECTING;
+   ns->time = clock_ms();
+   ns->ka_timeout = -1;
+   ns->flush = 0;
+   ns->send_off = 0;
+   ns->rx.hdr_len = 0;
+   return ns->ev.fd;
+}
+
+
+/*! Grow the transaction table by a chunk of TRX_CHUNK transactions unless
+ *  the maximum number of transactions is reached. The new transactions are
+ *  pushed onto the stack of free transactions.
+ *  @param ctx Pointer to the dispatcher context.
+ *  @return Returns 0 on success or -1 if the table cannot grow.
+ */
+static int grow_trx(dns_ctx_t *ctx)
+{
+   dns_trx_t *chunk;
+   int i, n;
+
+   if ((n = ctx->max_trx - ctx->trx_cnt) <= 0)
+      return -1;
+   if (n > TRX_CHUNK)
+      n = TRX_CHUNK;
+
+   if ((chunk = calloc(n, sizeof(*chunk))) == NULL)
+   {
+      log_msg(LOG_ERR, "could not grow trx table: %s", strerror(errno));
+      return -1;
+   }
+   ctx->trx_chunk[ctx->chunk_cnt++] = chunk;
+   ctx->trx_cnt += n;
+
+   for (i = n - 1; i >= 0; i--)
+   {
+      chunk[i].fnext = ctx->free_trx;
+      ctx->free_trx = &chunk[i];
+   }
+   log_msg(LOG_DEBUG, "trx table grown to %d entries", ctx->trx_cnt);
+   return 0;
+}
+
+
+/*! Get_free_trx() returns a pointer to a currently unused transaction
+ *  structure. It is taken from the stack of free transactions in O(1). The
+ *  table is grown if there is no free transaction.
+ *  @param ctx Pointer to the dispatcher context.
+ *  @return Returns a valid pointer or NULL of no entry is available. The
+ *  connection state of the new transaction is CONN_STATE_NEW.
+ */
+static dns_trx_t *get_free_trx(dns_ctx_t *ctx)
+{
+   dns_trx_t *trx;
+
+   if (ctx->free_trx == NULL && grow_trx(ctx) == -1)
+      return NULL;
+   trx = ctx->free_trx;
+   ctx->free_trx = trx->fnext;
+   trx->fnext = NULL;
+   ctx->active_cnt++;
+
+   trx->conn_state = CONN_STATE_NEW;
+   trx->retry = 0;
+   trx->inflight = 0;
+   trx->waiters = trx->leader = NULL;
+   trx->cl = NULL;
+   trx->hedge = NULL;
+   trx->is_hedge = 0;
+   trx->probe = NULL;
+   trx->ping = 0;
+   trx->keepalive = 0;
+   return trx;
+}
+
+
+/*! Push a transaction onto the stack of free transactions.
+ *  @param ctx Pointer to the dispatcher context.
+ *  @param trx Pointer to the transaction.
+ */
+static void put_free_trx(dns_ctx_t *ctx, dns_trx_t *trx)
+{
+   ctx->active_cnt--;
+   trx->conn_state = CONN_STATE_NA;
+   trx->fnext = ctx->free_trx;
+   ctx->free_trx = trx;
+}
+
+
+/*! Make sure that the data buffer of a transaction has at least the given
+ *  size. A larger buffer is taken from the buffer pool if necessary, the
+ *  contents of the current buffer is retained.
+ *  @param ctx Pointer to the dispatcher context.
+ *  @param trx Pointer to the transaction.
+ *  @param size Required size of the buffer.
+ *  @return Returns 0 on success or -1 in case of error.
+ */
+static int trx_buf(dns_ctx_t *ctx, dns_trx_t *trx, int size)
+{
+   char *buf;
+   int cap;
+
+   if (size <= trx->data_size)
+      return 0;
+
+   if ((buf = pool_get(&ctx->pool, size, &cap)) == NULL)
+      return -1;
+
+   if (trx->data != NULL)
+      memcpy(buf, trx->data, trx->data_len);
+   pool_put(&ctx->pool, trx->data, trx->data_size);
+   trx->data = buf;
+   trx->data_size = cap;
+   return 0;
+}
+
+
+/*! Discard a partially received frame of a TCP session.
+ *  @param ctx Pointer to the dispatcher context.
+ *  @param fr Pointer to the receive state of the session.
+ */
+static void frame_free(dns_ctx_t *ctx, frame_rx_t *fr)
+{
+   pool_put(&ctx->pool, fr->msg, fr->msg_size);
+   fr->msg = NULL;
+   fr->hdr_len = 0;
+}
+
+
+/*! Look up an outstanding query with the same question as that of a
+ *  transaction.
+ *  @param ctx Pointer to the dispatcher context.
+ *  @param trx Pointer to the transaction.
+ *  @return Returns a pointer to the transaction of the outstanding query or
+ *  NULL if there is none.
+ */
+static dns_trx_t *inflight_find(const dns_ctx_t *ctx, const dns_trx_t *trx)
+{
+   dns_trx_t *t;
+
+   for (t = ctx->inflight[trx->hash & ctx->inflight_mask]; t != NULL; t = t->hnext)
+      if (t->hash == trx->hash && t->qlen == trx->qlen && t->cflags == trx->cflags &&
+            !cache_qcmp(&t->data[2], &trx->data[2], trx->qlen))
+         return t;
+   return NULL;
+}
+
+
+static void inflight_add(dns_ctx_t *ctx, dns_trx_t *trx)
+{
+   dns_trx_t **tp = &ctx->inflight[trx->hash & ctx->inflight_mask];
+
+   trx->hnext = *tp;
+   *tp = trx;
+   trx->inflight = 1;
+}
+
+
+static void inflight_remove(dns_ctx_t *ctx, dns_trx_t *trx)
+{
+   dns_trx_t **tp;
+
+   if (!trx->inflight)
+      return;
+
+   for (tp = &ctx->inflight[trx->hash & ctx->inflight_mask]; *tp != NULL; tp = &(*tp)->hnext)
+      if (*tp == trx)
+      {
+         *tp = trx->hnext;
+         break;
+      }
+   trx->hnext = NULL;
+   trx->inflight = 0;
+}
+
+
+/*! Free the structure of a TCP client session if the session is closed,
+ *  none of its transactions is left, and it is not on the flush list.
+ *  @param cl Pointer to the session.
+ */
+static void cl_release(cl_conn_t *cl)
+{
+   if (cl->closed && !cl->refs && !cl->flush)
+      free(cl);
+}
+
+
+/*! Remove a transaction from the queue of its NS session and release its
+ *  message ID on the session. The original ID is restored in the query.
+ *  @param trx Pointer to the transaction.
+ */
+static void unqueue_trx(dns_trx_t *trx)
+{
+   if (trx->ns == NULL)
+      return;
+
+   if (trx->conn_state == CONN_STATE_SEND)
+      trxq_remove(&trx->ns->sendq, trx);
+   else if (trx->conn_state == CONN_STATE_RECV)
+      trxq_remove(&trx->ns->waitq, trx);
+   idmap_put(&trx->ns->idmap, trx->ns_id);
+   *((uint16_t*) &trx->data[2]) = trx->id;
+   trx->ns = NULL;
+}
+
+
+/*! Remove a query from its NS session before it was answered. A partially
+ *  sent query cannot be removed from the stream. In that case the session is
+ *  marked to be reset, it is closed with the next flush and its remaining
+ *  queries are requeued. The session is not closed immediately because this
+ *  may be called while an answer of another session is processed.
+ *  @param trx Pointer to the transaction.
+ */
+static void cancel_query(dns_trx_t *trx)
+{
+   ns_conn_t *ns = trx->ns;
+
+   if (ns != NULL && ns->sendq.head == trx && ns->send_off)
+   {
+      ns->send_off = 0;
+      ns->reset = 1;
+      ns->flush = 1;
+   }
+   unqueue_trx(trx);
+}
+
+
+/*! Release a transaction, i.e. return it to the free transactions. If other
+ *  transactions are waiting for the same answer they are released as well,
+ *  and so is a hedge of the query.
+ *  @param ctx Pointer to the dispatcher context.
+ *  @param trx Pointer to the transaction.
+ */
+static void release_trx(dns_ctx_t *ctx, dns_trx_t *trx)
+{
+   dns_trx_t *w;
+
+   if (trx->conn_state == CONN_STATE_NA)
+      return;
+
+   // a hedge is useless without its query
+   if ((w = trx->hedge) != NULL)
+   {
+      trx->hedge = w->hedge = NULL;
+      if (!trx->is_hedge)
+      {
+         cancel_query(w);
+         release_trx(ctx, w);
+      }
+   }
+
+   if (trx->probe != NULL)
+   {
+      trx->probe->probing = 0;
+      trx->probe = NULL;
+   }
+
+   tw_del(&ctx->timers, &trx->timer);
+   inflight_remove(ctx, trx);
+   while ((w = trx->waiters) != NULL)
+   {
+      trx->waiters = w->next;
+      w->next = NULL;
+      w->leader = NULL;
+      release_trx(ctx, w);
+   }
+
+   if (trx->cl != NULL)
+   {
+      trx->cl->refs--;
+      cl_release(trx->cl);
+      trx->cl = NULL;
+   }
+
+   trx->ns = NULL;
+   trx->data_len = 0;
+   pool_put(&ctx->pool, trx->data, trx->data_size);
+   trx->data = NULL;
+   trx->data_size = 0;
+   put_free_trx(ctx, trx);
+}
+
+
+/*! Attach a transaction to an outstanding query with the same question if
+ *  there is one. Otherwise the transaction is added to the in-flight table.
+ *  @param ctx Pointer to the dispatcher context.
+ *  @param trx Pointer to the transaction.
+ *  @return Returns 1 if the transaction was attached to another one,
+ *  otherwise 0.
+ */
+static int coalesce_trx(dns_ctx_t *ctx, dns_trx_t *trx)
+{
+   dns_trx_t *t;
+
+   trx->waiters = NULL;
+   trx->inflight = 0;
+   if (cache_qhash(&trx->data[2], trx->qlen, trx->cflags, &trx->hash) == -1)
+      return 0;
+
+   if ((t = inflight_find(ctx, trx)) == NULL)
+   {
+      inflight_add(ctx, trx);
+      return 0;
+   }
+
+   log_msg(LOG_DEBUG, "id = 0x%04x waits for answer of id = 0x%04x", (int) ntohs(trx->id), (int) ntohs(t->id));
+   trx->conn_state = CONN_STATE_WAIT;
+   trx->leader = t;
+   trx->next = t->waiters;
+   t->waiters = trx;
+   ctx->stats.coalesced++;
+   return 1;
+}
+
+
+/*! Return the number of queries queued on a session.
+ */
+static int ns_load(const ns_conn_t *ns)
+{
+   return ns->sendq.cnt + ns->waitq.cnt;
+}
+
+
+/*! Return the number of queries outstanding on an upstream.
+ */
+static int up_load(const upstream_t *up)
+{
+   int i, load = 0;
+
+   for (i = 0; i < up->ns_cnt; i++)
+      load += ns_load(&up->ns[i]);
+   return load;
+}
+
+
+/*! Return the number of sessions to an upstream which are not closed.
+ */
+static int up_open(const upstream_t *up)
+{
+   int i, open = 0;
+
+   for (i = 0; i < up->ns_cnt; i++)
+      open += up->ns[i].state != NS_STATE_CLOSED;
+   return open;
+}
+
+
+/*! Return the expected latency of a new query on an upstream. This is the
+ *  smoothed RTT weighted by the number of outstanding queries. An upstream
+ *  which was not measured yet is assumed to be as slow as the timeout, thus
+ *  client queries are not routed to it before it has proven to work. It is
+ *  measured by the keepalive query of its first session, see ns_pool().
+ */
+static uint64_t up_cost(const dns_ctx_t *ctx, const upstream_t *up)
+{
+   // 1 ms is added, otherwise the load would not count if the RTT is < 1 ms
+   return (uint64_t) ((up->srtt == -1 ? ctx->timeout * 8000 : up->srtt) + 8) * (up_load(up) + 1);
+}
+
+
+/*! Return the bucket of an RTT within the RTT histogram. Up to 3 ms every
+ *  millisecond has its own bucket, above every octave is split into 4
+ *  buckets, i.e. the resolution is better than 25%.
+ *  @param rtt RTT [ms].
+ *  @return Returns the index of the bucket.
+ */
+static int rtt_bucket(uint64_t rtt)
+{
+   int e, b;
+
+   if (rtt < 4)
+      return rtt;
+
+   for (e = 2; rtt >> (e + 1); e++);
+   b = (e - 1) * 4 + ((rtt >> (e - 2)) & 3);
+   return b < RTT_HIST_SIZE ? b : RTT_HIST_SIZE - 1;
+}
+
+
+/*! Return the upper limit of a bucket of the RTT histogram, i.e. the
+ *  smallest RTT [ms] beyond the bucket.
+ */
+static int rtt_limit(int b)
+{
+   if (b < 4)
+      return b + 1;
+   return (4 + b % 4 + 1) << (b / 4 - 1);
+}
+
+
+/*! Update the 95th percentile of the RTT of an upstream from its histogram.
+ *  It is the upper limit of the bucket in which the slowest 5% of the samples
+ *  begin.
+ */
+static void up_p95(upstream_t *up)
+{
+   unsigned sum = 0;
+   int b;
+
+   if (up->rtt_cnt < HEDGE_MIN_SAMPLES)
+   {
+      up->p95 = -1;
+      return;
+   }
+
+   for (b = RTT_HIST_SIZE - 1; b > 0; b--)
+      if ((sum += up->rtt_hist[b]) * 20 > up->rtt_cnt)
+         break;
+   up->p95 = rtt_limit(b);
+}
+
+
+/*! Add an RTT sample to the smoothed RTT of an upstream. The gain is 1/8 as
+ *  for the SRTT of TCP (RFC 6298). The sample is also added to the RTT
+ *  histogram. Its counts are halved regularly, thus old samples fade out.
+ *  @param up Pointer to the upstream.
+ *  @param rtt RTT [ms].
+ */
+static void up_rtt(upstream_t *up, uint64_t rtt)
+{
+   int i;
+
+   if (up->srtt == -1)
+      up->srtt = rtt * 8;
+   else
+      up->srtt += (int) rtt - (up->srtt >> 3);
+   up->last = clock_ms();
+
+   up->rtt_hist[rtt_bucket(rtt)]++;
+   if (++up->rtt_cnt > RTT_HIST_MAX)
+      for (i = 0, up->rtt_cnt = 0; i < RTT_HIST_SIZE; i++)
+         up->rtt_cnt += up->rtt_hist[i] >>= 1;
+   up_p95(up);
+}
+
+
+/*! Record a failure of an upstream, i.e. a failed connection attempt or a
+ *  session which broke while queries were outstanding, see close_ns().
+ *  Timeouts do not count, a slow answer is no transport fault. After
+ *  UP_MAX_FAILS consecutive failures the circuit breaker opens: the upstream
+ *  is not selected for queries anymore but only probed in the background, see
+ *  probe_up().
+ *  @param up Pointer to the upstream.
+ */
+static void up_fail(upstream_t *up)
+{
+   if (++up->fails < UP_MAX_FAILS || up->down)
+      return;
+
+   log_msg(LOG_WARN, "upstream %s failed %d times, taking it out of rotation", up->name, up->fails);
+   up->down = 1;
+   up->probe_ivl = PROBE_MIN_IVL;
+   up->probe_time = clock_ms() + up->probe_ivl;
+}
+
+
+/*! Record an answer of an upstream. This closes the circuit breaker.
+ *  @param up Pointer to the upstream.
+ */
+static void up_ok(upstream_t *up)
+{
+   up->fails = 0;
+   if (!up->down)
+      return;
+
+   log_msg(LOG_NOTICE, "upstream %s is up again", up->name);
+   up->down = 0;
+}
+
+
+/*! Return a pseudo random number (xorshift). Every worker has its own state
+ *  thus no locking is involved as with random().
+ */
+static uint32_t ctx_random(dns_ctx_t *ctx)
+{
+   ctx->rnd ^= ctx->rnd << 13;
+   ctx->rnd ^= ctx->rnd >> 17;
+   ctx->rnd ^= ctx->rnd << 5;
+   return ctx->rnd;
+}
+
+
+/*! Select a session to an upstream. The least loaded open session is chosen,
+ *  established sessions are preferred to those in connection setup. A new
+ *  session is opened if there is none or if all of them carry at least
+ *  NS_CONN_LOAD queries. In the latter case the query stays on the loaded
+ *  session, thus it does not wait for the connection setup. If there is no
+ *  session the query is parked on the new one until it is established. No
+ *  session is opened to an upstream which is down unless it is probed.
+ *  @param ctx Pointer to the dispatcher context.
+ *  @param up Pointer to the upstream.
+ *  @return Returns a pointer to the session or NULL if there is none.
+ */
+static ns_conn_t *select_session(dns_ctx_t *ctx, upstream_t *up)
+{
+   ns_conn_t *ns, *best = NULL, *unused = NULL;
+   int i;
+
+   for (i = 0, ns = up->ns; i < up->ns_cnt; i++, ns++)
+   {
+      if (ns->state == NS_STATE_CLOSED)
+      {
+         if (unused == NULL)
+            unused = ns;
+         continue;
+      }
+
+      // all message IDs are in use or the session is about to be reset
+      if (!ns->idmap.cnt || ns->reset)
+         continue;
+
+      if (best == NULL || (ns->state == NS_STATE_CONNECTED && best->state != NS_STATE_CONNECTED) ||
+            (ns->state == best->state && ns_load(ns) < ns_load(best)))
+         best = ns;
+   }
+
+   if (unused != NULL && (best == NULL || ns_load(best) >= NS_CONN_LOAD) && (!up->down || up->probing))
+   {
+      if (connect_to_dns_server(ctx, unused) == -1)
+         up_fail(up);
+      else if (best == NULL)
+         return unused;
+   }
+
+   return best;
+}
+
+
+/*! Return if an upstream is known to work, i.e. it has an established
+ *  session, or it has a session in connection setup or a measured RTT and
+ *  did not fail since. Requeued queries are only sent to such upstreams.
+ */
+static int up_alive(const upstream_t *up)
+{
+   int i;
+
+   for (i = 0; i < up->ns_cnt; i++)
+      if (up->ns[i].state == NS_STATE_CONNECTED)
+         return 1;
+   if (up->fails)
+      return 0;
+   return up->srtt != -1 || up_open(up);
+}
+
+
+/*! Return if an upstream must not be selected, see select_ns().
+ */
+static int up_skip(const upstream_t *up, int alive)
+{
+   return up->down || (alive && !up_alive(up));
+}
+
+
+/*! Select a session to the NS for a new query. Two different upstreams are
+ *  chosen randomly and the one with the lower expected latency is taken
+ *  (power of two choices). This avoids that all workers pile onto the same
+ *  upstream while a slow one gets only little traffic. If neither of them has
+ *  a session available all upstreams are tried. Upstreams which are down are
+ *  never selected, thus no connection attempts are wasted on them.
+ *  @param ctx Pointer to the dispatcher context.
+ *  @param excl Pointer to an upstream which must not be selected, or NULL.
+ *  @param alive Set if only upstreams which are known to work may be
+ *  selected, see up_alive().
+ *  @return Returns a pointer to the session or NULL if there is none.
+ */
+static ns_conn_t *select_ns(dns_ctx_t *ctx, const upstream_t *excl, int alive)
+{
+   upstream_t *a, *b, *t;
+   ns_conn_t *ns;
+   int i, n;
+
+   // the upstreams are numbered without excl
+   n = ctx->up_cnt - (excl != NULL);
+   if (n > 1)
+   {
+      i = ctx_random(ctx) % n;
+      a = &ctx->up[i];
+      b = &ctx->up[(i + 1 + ctx_random(ctx) % (n - 1)) % n];
+      if (excl != NULL)
+      {
+         a += a >= excl;
+         b += b >= excl;
+      }
+      if (up_cost(ctx, b) < up_cost(ctx, a))
+      {
+         t = a;
+         a = b;
+         b = t;
+      }
+      if ((!up_skip(a, alive) && (ns = select_session(ctx, a)) != NULL) || (!up_skip(b, alive) && (ns = select_session(ctx, b)) != NULL))
+         return ns;
+   }
+
+   for (i = 0; i < ctx->up_cnt; i++)
+      if (&ctx->up[i] != excl && !up_skip(&ctx->up[i], alive) && (ns = select_session(ctx, &ctx->up[i])) != NULL)
+         return ns;
+   return NULL;
+}
+
+
+static void hedge_trx(void *p, void *data);
+
+/*! Queue the query of a transaction on a session. The message ID of the
+ *  query is replaced by one which is unique on the session. The data is sent
+ *  when the send queues are flushed. A query (but not a hedge, a probe, or a
+ *  keepalive query) is hedged if it is not answered within the 95th
+ *  percentile of the RTT of the upstream, see hedge_trx(). Each query adds to
+ *  the budget of hedges.
+ *  @param ctx Pointer to the dispatcher context.
+ *  @param trx Pointer to the transaction.
+ *  @param ns Pointer to the session.
+ */
+static void queue_query_ns(dns_ctx_t *ctx, dns_trx_t *trx, ns_conn_t *ns)
+{
+   trx->ns_id = idmap_get(&ns->idmap, trx);
+   *((uint16_t*) &trx->data[2]) = htons(trx->ns_id);
+   trx->ns = ns;
+   trx->sent = clock_ms();
+   ns->up->queries++;
+   tap_trx(ctx, trx, DNSTAP_FORWARDER_QUERY, &trx->data[2], trx->data_len - 2);
+   trx->conn_state = CONN_STATE_SEND;
+   trxq_append(&ns->sendq, trx);
+   ns->flush = 1;
+
+   if (trx->is_hedge || trx->probe != NULL || trx->ping || !ctx->hedge_pct || ctx->up_cnt < 2)
+      return;
+
+   if ((ctx->hedge_credit += ctx->hedge_pct) > HEDGE_BURST * 100)
+      ctx->hedge_credit = HEDGE_BURST * 100;
+   if (ns->up->p95 != -1 && trx->sent + ns->up->p95 < trx->time + ctx->timeout * 1000)
+   {
+      trx->timer.func = hedge_trx;
+      tw_add(&ctx->timers, &trx->timer, trx->sent + ns->up->p95);
+   }
+}
+
+
+/*! Queue the query of a transaction to the NS.
+ *  @param ctx Pointer to the dispatcher context.
+ *  @param trx Pointer to the transaction.
+ *  @param alive Set if only upstreams which are known to work may be
+ *  selected, see up_alive().
+ *  @return Returns 0 on success or -1 if no session is available. In the
+ *  latter case the transaction is released.
+ */
+static int queue_query(dns_ctx_t *ctx, dns_trx_t *trx, int alive)
+{
+   ns_conn_t *ns;
+
+   if ((ns = select_ns(ctx, NULL, alive)) == NULL)
+   {
+      log_msg(LOG_WARN, "no session to NS available, dropping request");
+      release_trx(ctx, trx);
+      return -1;
+   }
+
+   queue_query_ns(ctx, trx, ns);
+   return 0;
+}
+
+
+/*! Close a session to the NS. All transactions which are queued on the
+ *  session are requeued to an upstream which is known to work (see
+ *  up_alive()) unless they exceeded the maximum number of retries. Hedges,
+ *  probes, and keepalive queries are not requeued but released, and a
+ *  requeued query loses its hedge. Thus a query and its hedge are never
+ *  queued on the same session. A session which could not be established
+ *  counts as a failure of its upstream, but not as a retry of its queries
+ *  because they were never sent. A session which broke (error or EOF) while
+ *  queries were outstanding counts as a failure as well.
+ *  @param ctx Pointer to the dispatcher context.
+ *  @param ns Pointer to the session.
+ */
+static void close_ns(dns_ctx_t *ctx, ns_conn_t *ns)
+{
+   trx_queue_t q[2] = {ns->waitq, ns->sendq};
+   int i, connecting = ns->state == NS_STATE_CONNECTING;
+   dns_trx_t *trx, *h;
+
+   log_msg(LOG_DEBUG, "closing session %d to NS, requeuing %d queries", ns->ev.fd, ns_load(ns));
+   // a reset by cancel_query() is no fault of the upstream
+   if (connecting || (ns_load(ns) && !ns->reset))
+      up_fail(ns->up);
+   // closing the file descriptor implicitly removes it from the epoll set
+   (void) close(ns->ev.fd);
+   ns->ev.fd = -1;
+   if (ns->race.fd != -1)
+   {
+      (void) close(ns->race.fd);
+      ns->race.fd = -1;
+   }
+   tw_del(&ctx->timers, &ns->race_timer);
+   ns->state = NS_STATE_CLOSED;
+   ns->reset = 0;
+   ns->sendq.head = ns->sendq.tail = ns->waitq.head = ns->waitq.tail = NULL;
+   ns->sendq.cnt = ns->waitq.cnt = 0;
+   frame_free(ctx, &ns->rx);
+
+   for (i = 0; i < 2; i++)
+      while ((trx = q[i].head) != NULL)
+      {
+         q[i].head = trx->next;
+         idmap_put(&ns->idmap, trx->ns_id);
+         *((uint16_t*) &trx->data[2]) = trx->id;
+         trx->ns = NULL;
+         if (trx->is_hedge || trx->probe != NULL || trx->ping)
+         {
+            release_trx(ctx, trx);
+            continue;
+         }
+         if ((h = trx->hedge) != NULL)
+         {
+            cancel_query(h);
+            release_trx(ctx, h);
+         }
+         // the query of a failed connection was never sent, this is no retry
+         if (!connecting && ++trx->retry > MAX_RETRY)
+         {
+            log_msg(LOG_WARN, "retries exceeded, dropping request");
+            release_trx(ctx, trx);
+            continue;
+         }
+         (void) queue_query(ctx, trx, 1);
+      }
+}
+
+
+/*! Send as many queued queries as possible on a session using a single
+ *  system call for up to MAX_IOV queries. Completely sent transactions are
+ *  moved to the wait queue.
+ *  @param ns Pointer to the session.
+ *  @return Returns 0 if the send queue was flushed or the socket buffer is
+ *  full, or -1 in case of error or if the session has to be reset.
+ */
+static int flush_ns(ns_conn_t *ns)
+{
+   struct iovec iov[MAX_IOV];
+   struct msghdr msg;
+   dns_trx_t *trx;
+   int len, total;
+
+   ns->flush = 0;
+   if (ns->reset)
+      return -1;
+
+   while (ns->sendq.head != NULL)
+   {
+      memset(&msg, 0, sizeof(msg));
+      msg.msg_iov = iov;
+      for (total = 0, trx = ns->sendq.head; trx != NULL && msg.msg_iovlen < MAX_IOV; trx = trx->next, msg.msg_iovlen++)
+      {
+         iov[msg.msg_iovlen].iov_base = trx->data;
+         iov[msg.msg_iovlen].iov_len = trx->data_len;
+         total += trx->data_len;
+      }
+      iov[0].iov_base = (char*) iov[0].iov_base + ns->send_off;
+      iov[0].iov_len -= ns->send_off;
+      total -= ns->send_off;
+
+      if ((len = sendmsg(ns->ev.fd, &msg, MSG_NOSIGNAL)) == -1)
+      {
+         if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return 0;
+         log_msg(LOG_ERR, "sending data on %d to NS failed: %s", ns->ev.fd, strerror(errno));
+         return -1;
+      }
+      log_msg(LOG_DEBUG, "sent %d/%d bytes of %d queries to NS on %d", len, total, (int) msg.msg_iovlen, ns->ev.fd);
+      ns->time = clock_ms();
+
+      // if all data of a transaction was sent move it to the wait queue
+      for (len += ns->send_off; (trx = ns->sendq.head) != NULL && len >= trx->data_len; len -= trx->data_len)
+      {
+         trxq_remove(&ns->sendq, trx);
+         trx->conn_state = CONN_STATE_RECV;
+         trxq_append(&ns->waitq, trx);
+      }
+      ns->send_off = len;
+
+      // socket buffer is full, wait for the next EPOLLOUT edge
+      if (ns->send_off)
+         return 0;
+   }
+   return 0;
+}
+
+
+/*! Handle a socket of a session becoming writable. This happens once an
+ *  asynchronous connect() finished (or failed) and whenever space becomes
+ *  available again in the socket buffer.
+ *  @param ctx Pointer to the dispatcher context.
+ *  @param ns Pointer to the session.
+ *  @param src Epoll source of the socket, either &ns->ev or &ns->race.
+ *  @return Returns 0 on success or -1 if the session failed.
+ */
+static int handle_ns_write(dns_ctx_t *ctx, ns_conn_t *ns, ev_src_t *src)
+{
+   const sock_addr_t *addr;
+   char buf[INET6_ADDRSTRLEN];
+   int so_err;
+   socklen_t so_err_len;
+
+   if (ns->state == NS_STATE_CONNECTING)
+   {
+      so_err_len = sizeof(so_err);
+      if (getsockopt(src->fd, SOL_SOCKET, SO_ERROR, &so_err, &so_err_len) == -1)
+         so_err = errno;
+
+      if (so_err)
+      {
+         addr = &ns->up->addr[src == &ns->race ? ns->race_ai : ns->ai];
+         log_msg(LOG_ERR, "could not connect to upstream %s via %s port %d: %s", ns->up->name, addr_str(&addr->sa, buf),
+               sa_port(addr), strerror(so_err));
+         return ns_attempt_failed(ctx, ns, src);
+      }
+
+      ns_connected(ctx, ns, src);
+   }
+
+   return flush_ns(ns);
+}
+
+
+/*! Update the events the UDP socket is registered for with epoll. It is
+ *  polled for reading unless input is paused and for writing while replies
+ *  are blocked.
+ *  @param ctx Pointer to the dispatcher context.
+ */
+static void set_udp_events(dns_ctx_t *ctx)
+{
+   struct epoll_event ev;
+
+   ev.events = (ctx->input_paused ? 0 : EPOLLIN) | (ctx->tx_blocked ? EPOLLOUT : 0);
+   ev.data.ptr = &ctx->udp_src;
+   if (epoll_ctl(ctx->efd, EPOLL_CTL_MOD, ctx->udp_sock, &ev) == -1)
+      log_msg(LOG_ERR, "epoll_ctl(%d) failed: %s", ctx->udp_sock, strerror(errno));
+}
+
+
+/*! Send the replies of the UDP send queue in batches of up to ctx->batch
+ *  datagrams with sendmmsg() and release the transactions. If the socket
+ *  buffer is full the remaining replies stay in the queue and the socket is
+ *  polled for writing.
+ *  @param ctx Pointer to the dispatcher context.
+ */
+static void flush_udp(dns_ctx_t *ctx)
+{
+   udp_batch_t *tx = &ctx->tx;
+   trx_ring_t *q = &ctx->txq;
+   dns_trx_t *trx;
+   int i, n;
+
+   while (q->cnt)
+   {
+      for (tx->cnt = 0; tx->cnt < ctx->batch && tx->cnt < q->cnt; tx->cnt++)
+      {
+         trx = q->trx[(q->head + tx->cnt) % q->size];
+         tx->trx[tx->cnt] = trx;
+         tx->iov[tx->cnt].iov_base = &trx->data[2];
+         tx->iov[tx->cnt].iov_len = trx->data_len - 2;
+         memset(&tx->msg[tx->cnt], 0, sizeof(*tx->msg));
+         tx->msg[tx->cnt].msg_hdr.msg_name = &trx->addr;
+         tx->msg[tx->cnt].msg_hdr.msg_namelen = trx->addr_len;
+         tx->msg[tx->cnt].msg_hdr.msg_iov = &tx->iov[tx->cnt];
+         tx->msg[tx->cnt].msg_hdr.msg_iovlen = 1;
+      }
+
+      if ((n = sendmmsg(ctx->udp_sock, tx->msg, tx->cnt, MSG_DONTWAIT)) == -1)
+      {
+         // socket buffer is full, wait until it becomes writable
+         if (errno == EAGAIN || errno == EWOULDBLOCK)
+         {
+            if (!ctx->tx_blocked)
+            {
+               log_msg(LOG_DEBUG, "udp socket blocked, %d replies pending", q->cnt);
+               ctx->tx_blocked = 1;
+               ctx->stats.tx_blocked++;
+               set_udp_events(ctx);
+            }
+            return;
+         }
+
+         log_msg(LOG_ERR, "sendmmsg() on udp failed: %s. dropping data", strerror(errno));
+         q->head = (q->head + 1) % q->size;
+         q->cnt--;
+         ctx->stats.tx_dropped++;
+         release_trx(ctx, tx->trx[0]);
+         continue;
+      }
+      ctx->stats.tx_calls++;
+      ctx->stats.tx_msgs += n;
+
+      q->head = (q->head + n) % q->size;
+      q->cnt -= n;
+      for (i = 0; i < n; i++)
+      {
+         trx = tx->trx[i];
+         log_msg(LOG_INFO, "replied %d/%d bytes on udp, id = 0x%04x, RCODE = %s", (int) tx->msg[i].msg_len, trx->data_len - 2,
+               (int) ntohs(trx->id), dns_rcode(trx->data[5] & 15));
+         release_trx(ctx, trx);
+      }
+   }
+   tx->cnt = 0;
+
+   if (ctx->tx_blocked)
+   {
+      ctx->tx_blocked = 0;
+      set_udp_events(ctx);
+   }
+}
+
+
+/*! Append the answer of a transaction to the UDP send queue. The queue is
+ *  flushed as soon as it contains a complete batch. If the queue is full
+ *  because the socket is blocked the answer is dropped.
+ *  @param ctx Pointer to the dispatcher context.
+ *  @param trx Pointer to the transaction containing the answer.
+ */
+static void queue_udp(dns_ctx_t *ctx, dns_trx_t *trx)
+{
+   trx_ring_t *q = &ctx->txq;
+
+   if (q->cnt >= q->size)
+   {
+      log_msg(LOG_DEBUG, "udp send queue full, dropping reply id = 0x%04x", (int) ntohs(trx->id));
+      ctx->stats.tx_dropped++;
+      release_trx(ctx, trx);
+      return;
+   }
+
+   q->trx[(q->head + q->cnt) % q->size] = trx;
+   q->cnt++;
+
+   if (!ctx->tx_blocked && q->cnt >= ctx->batch)
+      flush_udp(ctx);
+}
+
+
+/*! Append the answer of a transaction to the send queue of its TCP client
+ *  session. The session is put onto the flush list, thus all answers which
+ *  complete within a loop iteration are sent with a single system call. If
+ *  the query contained the edns-tcp-keepalive option the idle timeout of the
+ *  session is announced in the answer.
+ *  @param ctx Pointer to the dispatcher context.
+ *  @param trx Pointer to the transaction containing the answer.
+ */
+static void queue_tcp(dns_ctx_t *ctx, dns_trx_t *trx)
+{
+   cl_conn_t *cl = trx->cl;
+   int size;
+
+   if (cl->closed)
+   {
+      log_msg(LOG_DEBUG, "tcp session closed, dropping reply id = 0x%04x", (int) ntohs(trx->id));
+      release_trx(ctx, trx);
+      return;
+   }
+
+   if (trx->keepalive && trx_buf(ctx, trx, trx->data_len + 6) == 0)
+   {
+      size = trx->data_size - 2 < 0xffff ? trx->data_size - 2 : 0xffff;
+      trx->data_len = edns_set_keepalive(&trx->data[2], trx->data_len - 2, size, TCP_IDLE_TIMEOUT * 10) + 2;
+   }
+
+   // set length header for DNS/TCP
+   *((uint16_t*) &trx->data[0]) = htons(trx->data_len - 2);
+   trxq_append(&cl->sendq, trx);
+
+   if (!cl->flush)
+   {
+      cl->flush = 1;
+      cl->fnext = ctx->cl_flush;
+      ctx->cl_flush = cl;
+   }
+}
+
+
+/*! Send as many queued answers as possible on a TCP client session using a
+ *  single system call for up to MAX_IOV answers. Completely sent transactions
+ *  are released.
+ *  @param ctx Pointer to the dispatcher context.
+ *  @param cl Pointer to the session.
+ *  @return Returns 0 if the send queue was flushed or the socket buffer is
+ *  full, or -1 in case of error.
+ */
+static int flush_cl(dns_ctx_t *ctx, cl_conn_t *cl)
+{
+   struct iovec iov[MAX_IOV];
+   struct msghdr msg;
+   dns_trx_t *trx;
+   int len;
+
+   while (cl->sendq.head != NULL)
+   {
+      memset(&msg, 0, sizeof(msg));
+      msg.msg_iov = iov;
+      for (trx = cl->sendq.head; trx != NULL && msg.msg_iovlen < MAX_IOV; trx = trx->next, msg.msg_iovlen++)
+      {
+         iov[msg.msg_iovlen].iov_base = trx->data;
+         iov[msg.msg_iovlen].iov_len = trx->data_len;
+      }
+      iov[0].iov_base = (char*) iov[0].iov_base + cl->send_off;
+      iov[0].iov_len -= cl->send_off;
+
+      if ((len = sendmsg(cl->ev.fd, &msg, MSG_NOSIGNAL)) == -1)
+      {
+         if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return 0;
+         log_msg(LOG_NOTICE, "sending data on tcp %d failed: %s", cl->ev.fd, strerror(errno));
+         return -1;
+      }
+      tw_add(&ctx->timers, &cl->idle, clock_ms() + TCP_IDLE_TIMEOUT * 1000);
+
+      for (len += cl->send_off; (trx = cl->sendq.head) != NULL && len >= trx->data_len;)
+      {
+         len -= trx->data_len;
+         trxq_remove(&cl->sendq, trx);
+         log_msg(LOG_INFO, "replied %d bytes on tcp %d, id = 0x%04x, RCODE = %s", trx->data_len - 2, cl->ev.fd,
+               (int) ntohs(trx->id), dns_rcode(trx->data[5] & 15));
+         release_trx(ctx, trx);
+      }
+      cl->send_off = len;
+
+      // socket buffer is full, wait for the next EPOLLOUT edge
+      if (cl->send_off)
+         return 0;
+   }
+   return 0;
+}
+
+
+/*! Close a TCP client session. Answers which were not sent yet are dropped.
+ *  Outstanding transactions of the session still refer to it, they drop their
+ *  answers when they complete. The structure is freed with the last of them.
+ *  @param ctx Pointer to the dispatcher context.
+ *  @param cl Pointer to the session.
+ */
+static void close_cl(dns_ctx_t *ctx, cl_conn_t *cl)
+{
+   dns_trx_t *trx;
+
+   log_msg(LOG_DEBUG, "closing tcp session %d, %d queries outstanding", cl->ev.fd, cl->refs - cl->sendq.cnt);
+   // closing the file descriptor implicitly removes it from the epoll set
+   (void) close(cl->ev.fd);
+   cl->ev.fd = -1;
+   ctx->cl_cnt--;
+   tw_del(&ctx->timers, &cl->idle);
+   frame_free(ctx, &cl->rx);
+   while ((trx = cl->sendq.head) != NULL)
+   {
+      trxq_remove(&cl->sendq, trx);
+      release_trx(ctx, trx);
+   }
+   cl->send_off = 0;
+
+   // not before the queue is empty, release_trx() would free it
+   cl->closed = 1;
+   cl_release(cl);
+}
+
+
+/*! Timer callback which closes a TCP client session which was idle for
+ *  TCP_IDLE_TIMEOUT seconds. A session is not idle as long as it has
+ *  outstanding queries.
+ *  @param p Pointer to the dispatcher context.
+ *  @param data Pointer to the session.
+ */
+static void cl_idle(void *p, void *data)
+{
+   dns_ctx_t *ctx = p;
+   cl_conn_t *cl = data;
+
+   if (cl->refs)
+   {
+      tw_add(&ctx->timers, &cl->idle, clock_ms() + TCP_IDLE_TIMEOUT * 1000);
+      return;
+   }
+
+   log_msg(LOG_DEBUG, "tcp session %d idle", cl->ev.fd);
+   close_cl(ctx, cl);
+}
+
+
+/*! Queue the answer of a transaction to be sent back to the client, either
+ *  with UDP or on the TCP session of the client.
+ *  @param ctx Pointer to the dispatcher context.
+ *  @param trx Pointer to the transaction containing the answer.
+ */
+static void queue_reply(dns_ctx_t *ctx, dns_trx_t *trx)
+{
+   // the transaction is complete, it must not time out while it is queued
+   tw_del(&ctx->timers, &trx->timer);
+   trx->conn_state = CONN_STATE_REPLY;
+   tap_trx(ctx, trx, DNSTAP_CLIENT_RESPONSE, &trx->data[2], trx->data_len - 2);
+
+   if (trx->cl != NULL)
+      queue_tcp(ctx, trx);
+   else
+      queue_udp(ctx, trx);
+}
+
+
+/*! Log the statistic counters.
+ *  @param ctx Pointer to the dispatcher context.
+ */
+static void log_stats(const dns_ctx_t *ctx)
+{
+   const dns_stats_t *st = &ctx->stats;
+   unsigned long written, dropped;
+   const upstream_t *up;
+   char buf[INET6_ADDRSTRLEN];
+   int i;
+
+   log_msg(LOG_NOTICE, "udp rx: %lu datagrams in %lu batches (avg %.1f/%d), tx: %lu datagrams in %lu batches (avg %.1f/%d)",
+         st->rx_msgs, st->rx_calls, st->rx_calls ? (double) st->rx_msgs / st->rx_calls : 0.0, ctx->batch,
+         st->tx_msgs, st->tx_calls, st->tx_calls ? (double) st->tx_msgs / st->tx_calls : 0.0, ctx->batch);
+   log_msg(LOG_NOTICE, "trx table: %d/%d entries in use (max %d), input paused %lu times",
+         ctx->active_cnt, ctx->trx_cnt, ctx->max_trx, st->paused);
+   log_msg(LOG_NOTICE, "udp send queue: %d/%d replies pending, blocked %lu times, %lu replies dropped",
+         ctx->txq.cnt, ctx->txq.size, st->tx_blocked, st->tx_dropped);
+   log_msg(LOG_NOTICE, "tcp clients: %d sessions open, %lu accepted, %lu rejected, %lu queries",
+         ctx->cl_cnt, st->tcp_accepted, st->tcp_rejected, st->tcp_queries);
+   log_msg(LOG_NOTICE, "%lu queries coalesced", st->coalesced);
+   log_msg(LOG_NOTICE, "hedging: %lu hedges sent, %lu won, %lu suppressed by budget (%d%%)",
+         st->hedges, st->hedges_won, st->hedges_limited, ctx->hedge_pct);
+   for (i = 0, up = ctx->up; i < ctx->up_cnt; i++, up++)
+      log_msg(LOG_NOTICE, "upstream %s via %s (%s): srtt %.1f ms, p95 %d ms, %d/%d sessions open, %d queries outstanding, %lu queries, %lu answers, %lu timeouts, %lu probes",
+            up->name, addr_str(&up->addr[up->pref].sa, buf), up->down ? "down" : "up", up->srtt == -1 ? 0.0 : up->srtt / 8.0, up->p95, up_open(up), up->ns_cnt, up_load(up),
+            up->queries, up->answers, up->timeouts, up->probes);
+   log_msg(LOG_NOTICE, "%lu log messages dropped", log_dropped());
+   if (ctx->tap != NULL)
+   {
+      dnstap_stats(&written, &dropped);
+      log_msg(LOG_NOTICE, "dnstap: %lu frames written, %lu dropped", written, dropped);
+   }
+   log_msg(LOG_NOTICE, "buffers in use: %d/%d/%d, unused: %d/%d/%d (small/medium/large)",
+         ctx->pool.used_cnt[0], ctx->pool.used_cnt[1], ctx->pool.used_cnt[2],
+         ctx->pool.free_cnt[0], ctx->pool.free_cnt[1], ctx->pool.free_cnt[2]);
+   if (ctx->cache.size)
+      log_msg(LOG_NOTICE, "cache: %d/%d entries, %lu hits, %lu misses, %lu inserts",
+            ctx->cache.cnt, ctx->cache.size, ctx->cache.hits, ctx->cache.misses, ctx->cache.inserts);
+}
+
+
+/*! Enable or disable reading from the UDP socket and the listening TCP
+ *  socket. Input is paused while the transaction table is full, otherwise the
+ *  level-triggered sockets would be reported ready again immediately.
+ *  @param ctx Pointer to the dispatcher context.
+ *  @param on 0 to pause input, 1 to resume.
+ */
+static void set_input(dns_ctx_t *ctx, int on)
+{
+   struct epoll_event ev;
+
+   ctx->input_paused = !on;
+   set_udp_events(ctx);
+   ev.events = on ? EPOLLIN : 0;
+   ev.data.ptr = &ctx->tcp_src;
+   if (epoll_ctl(ctx->efd, EPOLL_CTL_MOD, ctx->tcp_sock, &ev) == -1)
+      log_msg(LOG_ERR, "epoll_ctl(%d) failed: %s", ctx->tcp_sock, strerror(errno));
+
+   if (on)
+      log_msg(LOG_INFO, "resuming input, %d/%d transactions in use", ctx->active_cnt, ctx->trx_cnt);
+   else
+   {
+      log_msg(LOG_WARN, "trx table full (%d entries), pausing input", ctx->trx_cnt);
+      ctx->stats.paused++;
+   }
+}
+
+
+/*! Process an answer received from the NS. The transaction is looked up by
+ *  the message ID, the answer is copied to the transaction, the original ID of
+ *  the client is restored, and the answer is queued to be sent back to the
+ *  client. The answer is also sent to all transactions which wait for the
+ *  same answer.
+ *  @param ctx Pointer to the dispatcher context.
+ *  @param p Pointer to the session (ns_conn_t) on which the answer was
+ *  received.
+ *  @param buf Pointer to the DNS message.
+ *  @param len Length of the message.
+ */
+static void ns_answer(dns_ctx_t *ctx, void *p, char *buf, int len)
+{
+   ns_conn_t *ns = p;
+   dns_trx_t *trx, *w, *h;
+   int qlen;
+
+   if (len < 12)
+   {
+      log_msg(LOG_WARN, "ignoring short answer (len = %d) on %d", len, ns->ev.fd);
+      return;
+   }
+
+   if ((trx = idmap_lookup(&ns->idmap, ntohs(*((uint16_t*) buf)))) == NULL || trx->conn_state != CONN_STATE_RECV)
+   {
+      log_msg(LOG_NOTICE, "no transaction for answer id = 0x%04x, dropping", (int) ntohs(*((uint16_t*) buf)));
+      return;
+   }
+
+   // make sure that the answer belongs to the question
+   qlen = trx->qlen;
+   if (len < DNS_HDR_LEN + qlen || memcmp(&trx->data[2 + DNS_HDR_LEN], buf + DNS_HDR_LEN, qlen))
+   {
+      log_msg(LOG_NOTICE, "question of answer id = 0x%04x does not match, dropping", (int) ntohs(*((uint16_t*) buf)));
+      return;
+   }
+
+   tap_trx(ctx, trx, DNSTAP_FORWARDER_RESPONSE, buf, len);
+   ns->up->answers++;
+   up_rtt(ns->up, clock_ms() - trx->sent);
+   up_ok(ns->up);
+   unqueue_trx(trx);
+
+   if (trx->ping && (qlen = edns_get_keepalive(buf, len)) != -1 && qlen != ns->ka_timeout)
+   {
+      log_msg(LOG_DEBUG, "idle timeout of session %d to NS is %d ms", ns->ev.fd, qlen * 100);
+      ns->ka_timeout = qlen;
+   }
+
+   if (trx->probe != NULL || trx->ping)
+   {
+      release_trx(ctx, trx);
+      return;
+   }
+
+   // the first answer wins, the hedge is released or the answer of the hedge
+   // continues with the original query
+   if ((h = trx->hedge) != NULL)
+   {
+      if (trx->is_hedge)
+      {
+         log_msg(LOG_DEBUG, "hedge of id = 0x%04x answered first", (int) ntohs(h->id));
+         ctx->stats.hedges_won++;
+         // the RTT of the upstream of the query is at least that long
+         up_rtt(h->ns->up, clock_ms() - h->sent);
+         cancel_query(h);
+         release_trx(ctx, trx);
+         trx = h;
+      }
+      else
+      {
+         cancel_query(h);
+         release_trx(ctx, h);
+      }
+   }
+
+   if (trx_buf(ctx, trx, len + 2) == -1)
+   {
+      release_trx(ctx, trx);
+      return;
+   }
+   memcpy(&trx->data[2], buf, len);
+   trx->data_len = len + 2;
+   *((uint16_t*) &trx->data[2]) = trx->id;
+   (void) cache_insert(&ctx->cache, &trx->data[2], len, trx->cflags, clock_ms() / 1000);
+
+   // the leader is queued last, queue_reply() may flush and release it
+   inflight_remove(ctx, trx);
+   while ((w = trx->waiters) != NULL)
+   {
+      trx->waiters = w->next;
+      w->next = NULL;
+      w->leader = NULL;
+      if (trx_buf(ctx, w, len + 2) == -1 ||
+            (qlen = cache_copy_answer(&w->data[2], w->qlen, w->data_size - 2, &trx->data[2], len)) == -1)
+      {
+         release_trx(ctx, w);
+         continue;
+      }
+      w->data_len = qlen + 2;
+      queue_reply(ctx, w);
+   }
+   queue_reply(ctx, trx);
+}
+
+
+/*! Function which is called for every DNS message received on a TCP session.
+ */
+typedef void (*frame_func_t)(dns_ctx_t *ctx, void *p, char *msg, int len);
+
+
+/*! Receive data on a TCP session.
+ *  @return Returns the number of bytes received, 0 if the socket would block,
+ *  -1 in case of error, or -2 if the peer closed the session.
+ */
+static int tcp_recv(int fd, char *buf, int len)
+{
+   if ((len = recv(fd, buf, len, 0)) == -1)
+   {
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+         return 0;
+      log_msg(LOG_ERR, "failed to recv() on tcp socket %d: %s", fd, strerror(errno));
+      return -1;
+   }
+
+   if (!len)
+      return -2;
+
+   log_msg(LOG_DEBUG, "received %d bytes on tcp socket %d", len, fd);
+   return len;
+}
+
+
+/*! Read DNS messages from a TCP session. Since the sockets are registered
+ *  edge-triggered data is read until the socket would block. The data stream
+ *  may contain several messages and messages may be split across several
+ *  reads. Every session has a small framing state machine: first the 2 byte
+ *  length header is collected, then the message. Complete messages within the
+ *  read buffer are processed in place. The beginning of a message which is not
+ *  received completely is copied to a buffer of the buffer pool which fits the
+ *  message, its remainder is received directly into that buffer.
+ *  @param ctx Pointer to the dispatcher context.
+ *  @param fd Socket of the session.
+ *  @param fr Pointer to the receive state of the session.
+ *  @param func Function which processes a message. The message is valid only
+ *  during the call.
+ *  @param p Pointer to the session which is passed to func.
+ *  @return Returns 0 if the socket would block, -1 in case of error, or -2 if
+ *  the peer closed the session.
+ */
+static int read_frames(dns_ctx_t *ctx, int fd, frame_rx_t *fr, frame_func_t func, void *p)
+{
+   int len, off, mlen;
+
+   for (;;)
+   {
+      // receive remainder of a partial message
+      if (fr->msg != NULL)
+      {
+         mlen = (fr->hdr[0] << 8) | fr->hdr[1];
+         if ((len = tcp_recv(fd, fr->msg + fr->msg_len, mlen - fr->msg_len)) <= 0)
+            return len;
+
+         if ((fr->msg_len += len) < mlen)
+            continue;
+
+         func(ctx, p, fr->msg, mlen);
+         frame_free(ctx, fr);
+         continue;
+      }
+
+      if ((len = tcp_recv(fd, ctx->ns_rbuf, NS_RBUF_SIZE)) <= 0)
+         return len;
+
+      for (off = 0; off < len;)
+      {
+         if (fr->hdr_len < 2)
+         {
+            fr->hdr[fr->hdr_len++] = ctx->ns_rbuf[off++];
+            // an empty message has no body
+            if (fr->hdr_len < 2 || fr->hdr[0] || fr->hdr[1])
+               continue;
+         }
+
+         mlen = (fr->hdr[0] << 8) | fr->hdr[1];
+         if (len - off < mlen)
+         {
+            if ((fr->msg = pool_get(&ctx->pool, mlen, &fr->msg_size)) == NULL)
+               return -1;
+            fr->msg_len = len - off;
+            memcpy(fr->msg, ctx->ns_rbuf + off, fr->msg_len);
+            break;
+         }
+
+         func(ctx, p, ctx->ns_rbuf + off, mlen);
+         off += mlen;
+         fr->hdr_len = 0;
+      }
+   }
+}
+
+
+/*! Handle incoming data on a session to the NS.
+ *  @param ctx Pointer to the dispatcher context.
+ *  @param ns Pointer to the session.
+ *  @return Returns 0 on success or -1 if the session is closed or failed.
+ */
+static int handle_ns_read(dns_ctx_t *ctx, ns_conn_t *ns)
+{
+   int e;
+
+   e = read_frames(ctx, ns->ev.fd, &ns->rx, ns_answer, ns);
+   ns->time = clock_ms();
+   if (e == -2)
+   {
+      log_msg(ns_load(ns) ? LOG_NOTICE : LOG_DEBUG, "NS closed session %d", ns->ev.fd);
+      return -1;
+   }
+   return e;
+}
+
+
+/*! Timer callback which removes a stale transaction, i.e. one which was not
+ *  answered within ctx->timeout seconds. Transactions waiting for the same
+ *  answer are released together with it.
+ *  @param p Pointer to the dispatcher context.
+ *  @param data Pointer to the transaction.
+ */
+static void expire_trx(void *p, void *data)
+{
+   dns_ctx_t *ctx = p;
+   dns_trx_t *trx = data;
+
+   log_msg(LOG_NOTICE, "removing stale transaction, id = 0x%04x", (int) ntohs(trx->id));
+   // a timeout counts as an RTT sample, this pushes slow upstreams away
+   if (trx->ns != NULL)
+   {
+      trx->ns->up->timeouts++;
+      up_rtt(trx->ns->up, clock_ms() - trx->sent);
+   }
+   cancel_query(trx);
+   release_trx(ctx, trx);
+}
+
+
+/*! Timer callback which hedges a query, i.e. a copy of it is sent to another
+ *  upstream if it was not answered within the 95th percentile of the RTT of
+ *  its upstream. The answer which arrives first is taken, see ns_answer().
+ *  The number of hedges is limited by the budget of ctx->hedge_pct percent of
+ *  the queries. The timer of the transaction is set to its timeout again.
+ *  @param p Pointer to the dispatcher context.
+ *  @param data Pointer to the transaction.
+ */
+static void hedge_trx(void *p, void *data)
+{
+   dns_ctx_t *ctx = p;
+   dns_trx_t *trx = data, *h;
+   ns_conn_t *ns;
+
+   trx->timer.func = expire_trx;
+   tw_add(&ctx->timers, &trx->timer, trx->time + ctx->timeout * 1000);
+
+   if (trx->ns == NULL || trx->hedge != NULL)
+      return;
+
+   if (ctx->hedge_credit < 100)
+   {
+      ctx->stats.hedges_limited++;
+      return;
+   }
+
+   if ((ns = select_ns(ctx, trx->ns->up, 0)) == NULL || (h = get_free_trx(ctx)) == NULL)
+      return;
+
+   if (trx_buf(ctx, h, trx->data_len) == -1)
+   {
+      release_trx(ctx, h);
+      return;
+   }
+   memcpy(h->data, trx->data, trx->data_len);
+   h->data_len = trx->data_len;
+   h->addr = trx->addr;
+   h->addr_len = trx->addr_len;
+   h->time = trx->time;
+   h->id = trx->id;
+   h->qlen = trx->qlen;
+   h->cflags = trx->cflags;
+   h->hash = trx->hash;
+   h->is_hedge = 1;
+   h->hedge = trx;
+   trx->hedge = h;
+
+   log_msg(LOG_DEBUG, "hedging id = 0x%04x after %d ms", (int) ntohs(trx->id), (int) (clock_ms() - trx->sent));
+   ctx->hedge_credit -= 100;
+   ctx->stats.hedges++;
+   queue_query_ns(ctx, h, ns);
+}
+
+
+/*! Process a new query of a client. The query is copied to the buffer of the
+ *  transaction, it is answered from the cache, attached to an outstanding
+ *  query with the same question, or queued to the NS.
+ *  @param ctx Pointer to the dispatcher context.
+ *  @param trx Pointer to the new transaction.
+ *  @param msg Pointer to the query. It has to be a buffer of UDP_RX_SIZE bytes
+ *  because answers from the cache are built within it.
+ *  @param len Length of the query.
+ */
+static void process_query(dns_ctx_t *ctx, dns_trx_t *trx, char *msg, int len)
+{
+   dns_query_t q;
+
+   // the query is parsed once, all of the following use the results
+   if (dns_query_parse(msg, len, &q) == -1 || q.qlen == -1)
+   {
+      log_msg(LOG_WARN, "ignoring malformed query (len = %d)", len);
+      release_trx(ctx, trx);
+      return;
+   }
+
+   // copy query to a buffer of the transaction leaving space for the
+   // length header of DNS/TCP
+   if (trx_buf(ctx, trx, len + 2) == -1)
+   {
+      release_trx(ctx, trx);
+      return;
+   }
+   memcpy(&trx->data[2], msg, len);
+   trx->data_len = len + 2;
+   trx->time = clock_ms();
+
+   log_query_in(trx, &q);
+   tap_trx(ctx, trx, DNSTAP_CLIENT_QUERY, msg, len);
+   trx->id = *((uint16_t*) msg);
+   trx->qlen = q.qlen;
+   trx->keepalive = trx->cl != NULL && edns_keepalive(msg, &q.opt);
+
+   // answer from cache if possible, it is built within the receive buffer
+   trx->cflags = cache_qflags(msg, &q);
+   if ((len = cache_lookup(&ctx->cache, msg, q.qlen, UDP_RX_SIZE, trx->cflags, clock_ms() / 1000)) != -1)
+   {
+      log_msg(LOG_DEBUG, "answering id = 0x%04x from cache", (int) ntohs(trx->id));
+      trx->data_len = 0;
+      if (trx_buf(ctx, trx, len + 2) == -1)
+      {
+         release_trx(ctx, trx);
+         return;
+      }
+      memcpy(&trx->data[2], msg, len);
+      trx->data_len = len + 2;
+      queue_reply(ctx, trx);
+      return;
+   }
+
+   if (coalesce_trx(ctx, trx))
+      return;
+
+   // set length header for DNS/TCP
+   *((uint16_t*) &trx->data[0]) = htons(trx->data_len - 2);
+   trx->timer.func = expire_trx;
+   trx->timer.data = trx;
+   tw_add(&ctx->timers, &trx->timer, trx->time + ctx->timeout * 1000);
+   (void) queue_query(ctx, trx, 0);
+}
+
+
+/*! Receive up to ctx->batch datagrams from UDP clients with a single system
+ *  call and create a new transaction for each of them. The datagrams are
+ *  received into the receive buffers of the batch. Queries which cannot be
+ *  answered from the cache are copied to a buffer of the buffer pool which
+ *  fits their size.
+ *  @param ctx Pointer to the dispatcher context.
+ *  @return 0 on success and -1 in case of a fatal error.
+ */
+static int handle_udp_in(dns_ctx_t *ctx)
+{
+   udp_batch_t *rx = &ctx->rx;
+   dns_trx_t *inp;
+   int i, n, len;
+
+   // assign free transactions to the batch
+   for (rx->cnt = 0; rx->cnt < ctx->batch && (inp = get_free_trx(ctx)) != NULL; rx->cnt++)
+   {
+      rx->trx[rx->cnt] = inp;
+      rx->iov[rx->cnt].iov_base = rx->buf + rx->cnt * UDP_RX_SIZE;
+      rx->iov[rx->cnt].iov_len = UDP_RX_SIZE;
+      memset(&rx->msg[rx->cnt], 0, sizeof(*rx->msg));
+      rx->msg[rx->cnt].msg_hdr.msg_name = &inp->addr;
+      rx->msg[rx->cnt].msg_hdr.msg_namelen = sizeof(inp->addr);
+      rx->msg[rx->cnt].msg_hdr.msg_iov = &rx->iov[rx->cnt];
+      rx->msg[rx->cnt].msg_hdr.msg_iovlen = 1;
+   }
+
+   if (!rx->cnt)
+   {
+      set_input(ctx, 0);
+      return 0;
+   }
+
+   n = recvmmsg(ctx->udp_sock, rx->msg, rx->cnt, MSG_DONTWAIT, NULL);
+
+   // return unused transactions
+   for (i = n > 0 ? n : 0; i < rx->cnt; i++)
+      release_trx(ctx, rx->trx[i]);
+
+   if (n == -1)
+   {
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+         return 0;
+      log_msg(LOG_ERR, "recvmmsg() on udp socket failed: %s", strerror(errno));
+      return -1;
+   }
+   ctx->stats.rx_calls++;
+   ctx->stats.rx_msgs += n;
+   log_msg(LOG_DEBUG, "received %d/%d datagrams", n, rx->cnt);
+
+   for (i = 0; i < n; i++)
+   {
+      inp = rx->trx[i];
+      inp->addr_len = rx->msg[i].msg_hdr.msg_namelen;
+      len = rx->msg[i].msg_len;
+
+      if (len < 12 || (rx->msg[i].msg_hdr.msg_flags & MSG_TRUNC))
+      {
+         log_msg(LOG_WARN, "ignoring datagram of invalid size (len = %d)", len);
+         release_trx(ctx, inp);
+         continue;
+      }
+
+      process_query(ctx, inp, rx->iov[i].iov_base, len);
+   }
+   return 0;
+}
+
+
+/*! Process a query received on a TCP client session. A new transaction is
+ *  created for every query thus many queries of a session may be outstanding
+ *  at the same time. The query is copied to the first receive buffer of the
+ *  UDP batch which is not in use meanwhile. A query which does not fit into it
+ *  (TCP allows up to 65535 bytes) is copied to a large buffer of the pool.
+ *  @param ctx Pointer to the dispatcher context.
+ *  @param p Pointer to the session (cl_conn_t).
+ *  @param msg Pointer to the DNS message.
+ *  @param len Length of the message.
+ */
+static void cl_query(dns_ctx_t *ctx, void *p, char *msg, int len)
+{
+   cl_conn_t *cl = p;
+   dns_trx_t *trx;
+   char *buf = ctx->rx.buf;
+   int cap = 0;
+
+   tw_add(&ctx->timers, &cl->idle, clock_ms() + TCP_IDLE_TIMEOUT * 1000);
+
+   if (len < 12)
+   {
+      log_msg(LOG_WARN, "ignoring query of invalid size (len = %d) on tcp %d", len, cl->ev.fd);
+      return;
+   }
+
+   if ((trx = get_free_trx(ctx)) == NULL)
+   {
+      log_msg(LOG_WARN, "trx table full, dropping query on tcp %d", cl->ev.fd);
+      return;
+   }
+
+   // the buffer has to hold an answer from the cache as well
+   if (len > UDP_RX_SIZE && (buf = pool_get(&ctx->pool, len, &cap)) == NULL)
+   {
+      log_msg(LOG_WARN, "no buffer for query (len = %d), dropping query on tcp %d", len, cl->ev.fd);
+      release_trx(ctx, trx);
+      return;
+   }
+
+   ctx->stats.tcp_queries++;
+   trx->cl = cl;
+   cl->refs++;
+   trx->addr = cl->addr;
+   trx->addr_len = cl->addr_len;
+   memcpy(buf, msg, len);
+   process_query(ctx, trx, buf, len);
+   if (cap)
+      pool_put(&ctx->pool, buf, cap);
+}
+
+
+/*! Handle events of a TCP client session. Pending answers are sent if the
+ *  socket became writable and new queries are read.
+ *  @param ctx Pointer to the dispatcher context.
+ *  @param cl Pointer to the session.
+ *  @param events Events reported by epoll.
+ *  @return Returns 0 on success or -1 if the session has to be closed because
+ *  it failed or the client closed it and all answers were sent.
+ */
+static int handle_cl(dns_ctx_t *ctx, cl_conn_t *cl, uint32_t events)
+{
+   int e;
+
+   if ((events & (EPOLLOUT | EPOLLERR)) && flush_cl(ctx, cl) == -1)
+      return -1;
+
+   if ((events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP)) && !cl->eof)
+   {
+      if ((e = read_frames(ctx, cl->ev.fd, &cl->rx, cl_query, cl)) == -1)
+         return -1;
+      // the client may still wait for the answers of its queries
+      if (e == -2)
+      {
+         log_msg(LOG_DEBUG, "client closed tcp session %d", cl->ev.fd);
+         cl->eof = 1;
+      }
+   }
+
+   return cl->eof && !cl->refs ? -1 : 0;
+}
+
+
+/*! Accept new incoming TCP sessions of clients. The sessions are registered
+ *  edge-triggered for both directions. If there are already MAX_TCP_CLIENTS
+ *  sessions, new sessions are closed immediately.
+ *  @param ctx Pointer to the dispatcher context.
+ */
+static void handle_tcp_accept(dns_ctx_t *ctx)
+{
+   struct epoll_event ev;
+   sock_addr_t addr;
+   socklen_t addr_len;
+   cl_conn_t *cl;
+   int i, fd, on = 1;
+
+   for (i = 0; i < ACCEPT_BATCH; i++)
+   {
+      addr_len = sizeof(addr);
+#ifdef USE_FCNTL
+      fd = accept(ctx->tcp_sock, &addr.sa, &addr_len);
+#else
+      fd = accept4(ctx->tcp_sock, &addr.sa, &addr_len, SOCK_NONBLOCK);
+#endif
+      if (fd == -1)
+      {
+         if (errno != EAGAIN && errno != EWOULDBLOCK)
+            log_msg(LOG_ERR, "accept(%d) failed: %s", ctx->tcp_sock, strerror(errno));
+         return;
+      }
+
+      SET_NONBLOCK(fd);
+
+      if (ctx->cl_cnt >= MAX_TCP_CLIENTS)
+      {
+         log_msg(LOG_WARN, "too many tcp sessions, rejecting %d", fd);
+         ctx->stats.tcp_rejected++;
+         (void) close(fd);
+         continue;
+      }
+
+      if ((cl = calloc(1, sizeof(*cl))) == NULL)
+      {
+         log_msg(LOG_ERR, "could not allocate tcp session: %s", strerror(errno));
+         (void) close(fd);
+         return;
+      }
+
+      // answers are sent as soon as they complete, don't let Nagle delay them
+      if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) == -1)
+         log_msg(LOG_WARN, "setsockopt(%d, TCP_NODELAY) failed: %s", fd, strerror(errno));
+
+      ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+      ev.data.ptr = cl;
+      if (epoll_ctl(ctx->efd, EPOLL_CTL_ADD, fd, &ev) == -1)
+      {
+         log_msg(LOG_ERR, "epoll_ctl(%d) failed: %s", fd, strerror(errno));
+         (void) close(fd);
+         free(cl);
+         continue;
+      }
+
+      cl->ev.type = EV_TCP_CLIENT;
+      cl->ev.fd = fd;
+      cl->addr = addr;
+      cl->addr_len = addr_len;
+      cl->idle.func = cl_idle;
+      cl->idle.data = cl;
+      tw_add(&ctx->timers, &cl->idle, clock_ms() + TCP_IDLE_TIMEOUT * 1000);
+      ctx->cl_cnt++;
+      ctx->stats.tcp_accepted++;
+      log_msg(LOG_INFO, "accepted new tcp session on %d", fd);
+   }
+}
+
+
+/*! Create a transaction for a query of utdns itself, i.e. one without a
+ *  client. The question has to be ". IN NS". The transaction expires after
+ *  PROBE_TIMEOUT seconds.
+ *  @param ctx Pointer to the dispatcher context.
+ *  @param msg Pointer to the query including the length header.
+ *  @param len Length of msg.
+ *  @return Returns a pointer to the transaction or NULL in case of error.
+ */
+static dns_trx_t *internal_trx(dns_ctx_t *ctx, const char *msg, int len)
+{
+   dns_trx_t *trx;
+
+   if ((trx = get_free_trx(ctx)) == NULL)
+      return NULL;
+
+   if (trx_buf(ctx, trx, len) == -1)
+   {
+      release_trx(ctx, trx);
+      return NULL;
+   }
+   memcpy(trx->data, msg, len);
+   trx->data_len = len;
+   trx->id = 0;
+   // root name, type, class
+   trx->qlen = 5;
+   trx->cflags = -1;
+   trx->time = clock_ms();
+   trx->timer.func = expire_trx;
+   trx->timer.data = trx;
+   tw_add(&ctx->timers, &trx->timer, trx->time + PROBE_TIMEOUT * 1000);
+   return trx;
+}
+
+
+/*! Send a probe query (". IN NS") to an upstream which is down. An answer
+ *  closes the circuit breaker, see ns_answer(). The interval to the next
+ *  probe is doubled up to PROBE_MAX_IVL.
+ *  @param ctx Pointer to the dispatcher context.
+ *  @param up Pointer to the upstream.
+ */
+static void probe_up(dns_ctx_t *ctx, upstream_t *up)
+{
+   // length header, header with RD set, root name, type NS, class IN
+   static const char probe[] = {0, 17, 0, 0, 1, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 2, 0, 1};
+   dns_trx_t *trx;
+   ns_conn_t *ns;
+
+   up->probe_time = clock_ms() + up->probe_ivl;
+   if ((up->probe_ivl <<= 1) > PROBE_MAX_IVL)
+      up->probe_ivl = PROBE_MAX_IVL;
+
+   // this lets select_session() open a session
+   up->probing = 1;
+   if ((ns = select_session(ctx, up)) == NULL || (trx = internal_trx(ctx, probe, sizeof(probe))) == NULL)
+   {
+      up->probing = 0;
+      return;
+   }
+
+   trx->probe = up;
+   up->probes++;
+
+   log_msg(LOG_DEBUG, "probing upstream, next probe in %d ms", up->probe_ivl);
+   queue_query_ns(ctx, trx, ns);
+}
+
+
+/*! Send a keepalive query (". IN NS" with an empty edns-tcp-keepalive option,
+ *  RFC 7828) on an idle session to the NS. The activity keeps the NS from
+ *  closing the session and the answer tells its idle timeout, see
+ *  ns_answer().
+ *  @param ctx Pointer to the dispatcher context.
+ *  @param ns Pointer to the session.
+ */
+static void ping_ns(dns_ctx_t *ctx, ns_conn_t *ns)
+{
+   // length header, header with RD set and ARCOUNT 1, root name, type NS,
+   // class IN, OPT RR with UDP size 4096 and option 11 of length 0
+   static const char ping[] = {0, 32, 0, 0, 1, 0, 0, 1, 0, 0, 0, 0, 0, 1, 0, 0, 2, 0, 1,
+      0, 0, 41, 16, 0, 0, 0, 0, 0, 0, 4, 0, 11, 0, 0};
+   dns_trx_t *trx;
+
+   // all message IDs are in use or the session is about to be reset
+   if (!ns->idmap.cnt || ns->reset || (trx = internal_trx(ctx, ping, sizeof(ping))) == NULL)
+      return;
+
+   log_msg(LOG_DEBUG, "sending keepalive on session %d to NS", ns->ev.fd);
+   trx->ping = 1;
+   queue_query_ns(ctx, trx, ns);
+}
+
+
+/*! Maintain the pool of sessions to an upstream. Idle sessions are closed
+ *  after NS_IDLE_TIMEOUT seconds unless this would leave fewer than
+ *  ctx->min_conn sessions open. The remaining idle sessions are kept open by
+ *  keepalive queries at half of the idle timeout announced by the NS, or
+ *  every NS_PING_IVL ms if it is unknown. Closed sessions are replaced in the
+ *  background, thus a query does not have to wait for a connection setup.
+ *  An upstream which failed or was not measured yet gets at least one
+ *  session. Nothing is opened to an upstream which is down.
+ *  @param ctx Pointer to the dispatcher context.
+ *  @param up Pointer to the upstream.
+ *  @param now Current time [ms].
+ */
+static void ns_pool(dns_ctx_t *ctx, upstream_t *up, uint64_t now)
+{
+   ns_conn_t *ns;
+   int i, open = up_open(up), min = ctx->min_conn;
+
+   // an upstream which failed or was not measured yet is avoided by
+   // select_ns(), it is connected to in the background to measure it or to
+   // open its breaker without sacrificing client queries
+   if (!min && (up->fails || up->srtt == -1))
+      min = 1;
+
+   for (i = 0, ns = up->ns; i < up->ns_cnt; i++, ns++)
+   {
+      if (ns->state == NS_STATE_CLOSED || ns_load(ns))
+         continue;
+
+      // a connection setup which takes that long is not waited for
+      if ((ns->state == NS_STATE_CONNECTING || open > min) && ns->time + NS_IDLE_TIMEOUT * 1000 < now)
+      {
+         close_ns(ctx, ns);
+         open--;
+      }
+      // surplus sessions are not kept open, they would never become idle
+      else if (ns->state == NS_STATE_CONNECTED && open <= min &&
+            ns->time + (ns->ka_timeout > 0 ? ns->ka_timeout * 50 : NS_PING_IVL) <= now)
+         ping_ns(ctx, ns);
+   }
+
+   for (i = 0, ns = up->ns; i < up->ns_cnt && open < min && !up->down; i++, ns++)
+   {
+      if (ns->state != NS_STATE_CLOSED)
+         continue;
+      if (connect_to_dns_server(ctx, ns) == -1)
+      {
+         up_fail(up);
+         continue;
+      }
+      open++;
+   }
+}
+
+
+/*! Periodic timer callback which maintains the pools of sessions to the NS
+ *  (see ns_pool()), lets the smoothed RTT of unused upstreams decay, and
+ *  probes upstreams which are down.
+ *  @param p Pointer to the dispatcher context.
+ *  @param data Unused.
+ */
+static void housekeeping(void *p, void *data)
+{
+   dns_ctx_t *ctx = p;
+   uint64_t now = clock_ms();
+   upstream_t *up;
+   int i;
+
+   (void) data;
+   for (i = 0, up = ctx->up; i < ctx->up_cnt; i++, up++)
+   {
+      ns_pool(ctx, up, now);
+      // the RTT of an upstream which is not selected anymore would never change
+      if (up->srtt > 0 && up->last + HOUSEKEEPING_INTERVAL <= now)
+         up->srtt -= up->srtt >> RTT_DECAY;
+      if (up->down && !up->probing && up->probe_time <= now)
+         probe_up(ctx, up);
+   }
+
+   tw_add(&ctx->timers, &ctx->housekeeping, now + HOUSEKEEPING_INTERVAL);
+}
+
+
+/*! Flush the send queues of all sessions to the NS which have pending data.
+ *  @param ctx Pointer to the dispatcher context.
+ */
+static void flush_all_ns(dns_ctx_t *ctx)
+{
+   ns_conn_t *ns;
+   int i, again;
+
+   // closing a session may requeue queries to other sessions
+   do
+   {
+      for (i = 0, again = 0, ns = ctx->ns; i < ctx->ns_cnt; i++, ns++)
+      {
+         if (ns->state != NS_STATE_CONNECTED || !ns->flush)
+            continue;
+
+         if (flush_ns(ns) == -1)
+         {
+            close_ns(ctx, ns);
+            again = 1;
+         }
+      }
+   }
+   while (again);
+}
+
+
+/*! Send the pending answers of all TCP client sessions on the flush list.
+ *  Sessions which were closed meanwhile are freed, sessions of clients which
+ *  finished and got all of their answers are closed.
+ *  @param ctx Pointer to the dispatcher context.
+ */
+static void flush_all_cl(dns_ctx_t *ctx)
+{
+   cl_conn_t *cl;
+
+   while ((cl = ctx->cl_flush) != NULL)
+   {
+      ctx->cl_flush = cl->fnext;
+      cl->fnext = NULL;
+      cl->flush = 0;
+
+      if (cl->closed)
+         cl_release(cl);
+      else if (flush_cl(ctx, cl) == -1 || (cl->eof && !cl->refs))
+         close_cl(ctx, cl);
+   }
+}
+
+
+/*! This is the main routing for dispatching packets between UDP and TCP
+ * clients and the TCP name server. It keeps track on all transactions within the
+ * transaction table. All sockets are registered with an epoll instance once
+ * thus the effort for each wakeup is proportional to the number of sockets
+ * which are ready. The queries are pipelined on a few persistent TCP sessions
+ * to the NS. Stale transactions are removed by their timer as soon as the
+ * timeout (ctx->timeout) elapses. The timeout of epoll_wait() is set to the
+ * next expiry of the timer wheel. While the transaction table is full the
+ * listening sockets are not polled.
+ * @param ctx Pointer to the dispatcher context.
+ * @return -1 in case of error.
+ */
+static int dispatch_packets(dns_ctx_t *ctx)
+{
+   struct epoll_event ev, events[MAX_EVENTS];
+   int i, nfds, timeout, running = 1;
+   int64_t next;
+   ns_conn_t *ns;
+
+   if ((ctx->efd = epoll_create1(0)) == -1)
+   {
+      log_msg(LOG_ERR, "epoll_create1() failed: %s", strerror(errno));
+      return -1;
+   }
+
+   // listening sockets are level-triggered, they are not drained at once
+   ctx->udp_src.type = EV_UDP;
+   ctx->udp_src.fd = ctx->udp_sock;
+   ctx->tcp_src.type = EV_TCP_LISTEN;
+   ctx->tcp_src.fd = ctx->tcp_sock;
+   ctx->input_paused = 0;
+   ctx->tx_blocked = 0;
+   ev.events = EPOLLIN;
+   ev.data.ptr = &ctx->udp_src;
+   if (epoll_ctl(ctx->efd, EPOLL_CTL_ADD, ctx->udp_sock, &ev) == -1)
+   {
+      log_msg(LOG_ERR, "epoll_ctl(%d) failed: %s", ctx->udp_sock, strerror(errno));
+      (void) close(ctx->efd);
+      return -1;
+   }
+   ev.data.ptr = &ctx->tcp_src;
+   if (epoll_ctl(ctx->efd, EPOLL_CTL_ADD, ctx->tcp_sock, &ev) == -1)
+   {
+      log_msg(LOG_ERR, "epoll_ctl(%d) failed: %s", ctx->tcp_sock, strerror(errno));
+      (void) close(ctx->efd);
+      return -1;
+   }
+
+   ctx->housekeeping.func = housekeeping;
+   ctx->housekeeping.data = NULL;
+   (void) clock_update();
+   // this opens the initial sessions to the NS and arms the timer
+   housekeeping(ctx, NULL);
+
+   while (running)
+   {
+      if (ctx->stats_gen != sig_stats_)
+      {
+         ctx->stats_gen = sig_stats_;
+         log_stats(ctx);
+      }
+
+      flush_all_ns(ctx);
+
+      // resume input not before 1/8 of the table is free again
+      if (ctx->input_paused && ctx->free_trx != NULL && ctx->active_cnt <= ctx->trx_cnt - ctx->trx_cnt / 8)
+         set_input(ctx, 1);
+
+      timeout = (next = tw_next(&ctx->timers)) == -1 || next > MAX_WAIT ? MAX_WAIT : (int) next;
+      if ((nfds = epoll_wait(ctx->efd, events, MAX_EVENTS, timeout)) == -1)
+      {
+         if (errno == EINTR)
+            continue;
+         log_msg(LOG_ERR, "epoll_wait() failed: %s", strerror(errno));
+         running = 0;
+         break;
+      }
+      // the time is read once per iteration, see clock.c
+      (void) clock_update();
+      log_msg(LOG_DEBUG, "%d sockets ready", nfds);
+
+      for (i = 0; i < nfds; i++)
+      {
+         switch (((ev_src_t*) events[i].data.ptr)->type)
+         {
+            case EV_UDP:
+               if ((events[i].events & EPOLLOUT) && ctx->tx_blocked)
+                  flush_udp(ctx);
+               if ((events[i].events & EPOLLIN) && handle_udp_in(ctx) == -1)
+                  running = 0;
+               break;
+
+            case EV_TCP_LISTEN:
+               handle_tcp_accept(ctx);
+               break;
+
+            case EV_TCP_CLIENT:
+               if (handle_cl(ctx, events[i].data.ptr, events[i].events) == -1)
+                  close_cl(ctx, events[i].data.ptr);
+               break;
+
+            case EV_NS:
+               ns = events[i].data.ptr;
+               // tcp socket is ready for sending
+               if ((events[i].events & (EPOLLOUT | EPOLLERR)) && ns->state != NS_STATE_CLOSED)
+                  if (handle_ns_write(ctx, ns, &ns->ev) == -1)
+                     close_ns(ctx, ns);
+               // incoming data on tcp socket
+               if ((events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP)) && ns->state == NS_STATE_CONNECTED)
+                  if (handle_ns_read(ctx, ns) == -1)
+                     close_ns(ctx, ns);
+               break;
+
+            case EV_NS_RACE:
+               // the source is the member race of the session
+               ns = (ns_conn_t*) ((char*) events[i].data.ptr - offsetof(ns_conn_t, race));
+               if ((events[i].events & (EPOLLOUT | EPOLLERR)) && ns->race.fd != -1)
+                  if (handle_ns_write(ctx, ns, &ns->race) == -1)
+                     close_ns(ctx, ns);
+               break;
+         }
+      }
+      flush_all_cl(ctx);
+      if (!ctx->tx_blocked)
+         flush_udp(ctx);
+      tw_advance(&ctx->timers, clock_ms());
+   }
+
+   for (i = 0, ns = ctx->ns; i < ctx->ns_cnt; i++, ns++)
+   {
+      if (ns->state != NS_STATE_CLOSED)
+         (void) close(ns->ev.fd);
+      if (ns->race.fd != -1)
+         (void) close(ns->race.fd);
+      frame_free(ctx, &ns->rx);
+      idmap_free(&ns->idmap);
+   }
+   (void) close(ctx->efd);
+   return running ? 0 : -1;
+}
+
+
+
+/*! Allocate the message headers of a UDP batch.
+ *  @param b Pointer to the batch.
+ *  @param size Maximum number of datagrams in the batch.
+ *  @param bufsize Size of the receive buffer of each datagram, 0 if the batch
+ *  has no buffers.
+ *  @return Returns 0 on success or -1 in case of error.
+ */
+static int init_batch(udp_batch_t *b, int size, int bufsize)
+{
+   b->msg = calloc(size, sizeof(*b->msg));
+   b->iov = calloc(size, sizeof(*b->iov));
+   b->trx = calloc(size, sizeof(*b->trx));
+   b->buf = bufsize ? malloc((size_t) size * bufsize) : NULL;
+   b->cnt = 0;
+
+   if (b->msg == NULL || b->iov == NULL || b->trx == NULL || (bufsize && b->buf == NULL))
+   {
+      log_msg(LOG_ERR, "could not allocate udp batch: %s", strerror(errno));
+      return -1;
+   }
+   return 0;
+}
+
+
+static void free_batch(udp_batch_t *b)
+{
+   free(b->msg);
+   free(b->iov);
+   free(b->trx);
+   free(b->buf);
+}
+
+
+static void sig_handler(int sig)
+{
+   if (sig == SIGUSR1)
+      sig_stats_++;
+}
+
+
+/*! Allocate the transaction table, the session table and the UDP batches of
+ *  a context.
+ *  @param ctx Pointer to the context.
+ *  @return Returns 0 on success or -1 in case of error.
+ */
+static int init_ctx(dns_ctx_t *ctx)
+{
+   upstream_t *up;
+   ns_conn_t *ns;
+   int i, j, per;
+
+   if ((ctx->trx_chunk = calloc((ctx->max_trx + TRX_CHUNK - 1) / TRX_CHUNK, sizeof(*ctx->trx_chunk))) == NULL)
+   {
+      log_msg(LOG_ERR, "could not allocate trx table: %s", strerror(errno));
+      return -1;
+   }
+   if (grow_trx(ctx) == -1)
+      return -1;
+
+   for (ctx->inflight_mask = 1; ctx->inflight_mask < (unsigned) ctx->max_trx; ctx->inflight_mask <<= 1);
+   if ((ctx->inflight = calloc(ctx->inflight_mask, sizeof(*ctx->inflight))) == NULL)
+   {
+      log_msg(LOG_ERR, "could not allocate in-flight table: %s", strerror(errno));
+      return -1;
+   }
+   ctx->inflight_mask--;
+
+   // ctx->up points to the upstreams of the command line, every worker keeps
+   // its own copy, ctx->ns_cnt is the number of sessions per upstream
+   up = ctx->up;
+   per = ctx->ns_cnt;
+   ctx->ns_cnt *= ctx->up_cnt;
+   if ((ctx->up = calloc(ctx->up_cnt, sizeof(*ctx->up))) == NULL || (ctx->ns = calloc(ctx->ns_cnt, sizeof(*ctx->ns))) == NULL ||
+         (ctx->ns_rbuf = malloc(NS_RBUF_SIZE)) == NULL)
+   {
+      log_msg(LOG_ERR, "could not allocate NS sessions: %s", strerror(errno));
+      return -1;
+   }
+   for (i = 0; i < ctx->up_cnt; i++)
+   {
+      // the addresses are shared by all workers
+      ctx->up[i].name = up[i].name;
+      ctx->up[i].addr = up[i].addr;
+      ctx->up[i].addr_cnt = up[i].addr_cnt;
+      ctx->up[i].srtt = -1;
+      ctx->up[i].p95 = -1;
+      ctx->up[i].ns = &ctx->ns[i * per];
+      ctx->up[i].ns_cnt = per;
+      for (j = 0; j < per; j++)
+      {
+         ns = &ctx->up[i].ns[j];
+         ns->up = &ctx->up[i];
+         ns->ev.type = EV_NS;
+         ns->ev.fd = -1;
+         ns->race.type = EV_NS_RACE;
+         ns->race.fd = -1;
+         ns->race_timer.func = ns_race;
+         ns->race_timer.data = ns;
+      }
+   }
+   // xorshift must not be seeded with 0
+   ctx->rnd = random() | 1;
+
+   pool_init(&ctx->pool);
+   tw_init(&ctx->timers, clock_ms(), ctx);
+   if (init_batch(&ctx->rx, ctx->batch, UDP_RX_SIZE) == -1 || init_batch(&ctx->tx, ctx->batch, 0) == -1)
+      return -1;
+
+   ctx->txq.size = UDP_TXQ_SIZE;
+   if ((ctx->txq.trx = calloc(ctx->txq.size, sizeof(*ctx->txq.trx))) == NULL)
+   {
+      log_msg(LOG_ERR, "could not allocate udp send queue: %s", strerror(errno));
+      return -1;
+   }
+
+   if (cache_init(&ctx->cache, ctx->cache_size) == -1)
+      return -1;
+
+   ctx->tap = dnstap_ring();
+   return 0;
+}
+
+
+static void free_ctx(dns_ctx_t *ctx)
+{
+   dns_trx_t *trx;
+   int i, j;
+
+   for (i = 0; i < ctx->chunk_cnt; i++)
+      for (j = 0, trx = ctx->trx_chunk[i]; j < TRX_CHUNK && i * TRX_CHUNK + j < ctx->trx_cnt; j++, trx++)
+         pool_put(&ctx->pool, trx->data, trx->data_size);
+   pool_free(&ctx->pool);
+   cache_free(&ctx->cache);
+   free_batch(&ctx->rx);
+   free_batch(&ctx->tx);
+   free(ctx->txq.trx);
+   free(ctx->ns);
+   free(ctx->up);
+   free(ctx->ns_rbuf);
+   free(ctx->inflight);
+   for (i = 0; i < ctx->chunk_cnt; i++)
+      free(ctx->trx_chunk[i]);
+   free(ctx->trx_chunk);
+   (void) close(ctx->tcp_sock);
+   (void) close(ctx->udp_sock);
+}
+
+
+#ifdef WITH_THREADS
+/*! Return the id of the current thread. This is used by the logger.
+ */
+int sm_thread_id(void)
+{
+   return thread_id_;
+}
+
+
+/*! Thread main function of a worker.
+ *  @param p Pointer to the context of the worker.
+ */
+static void *worker_main(void *p)
+{
+   dns_ctx_t *ctx = p;
+
+   thread_id_ = ctx->id;
+   log_msg(LOG_INFO, "worker %d started", ctx->id);
+   (void) dispatch_packets(ctx);
+   log_msg(LOG_NOTICE, "worker %d exiting", ctx->id);
+   return NULL;
+}
+#endif
+
+
+/*! Run the dispatcher of all workers. If there is just a single worker it is
+ *  run within the main thread.
+ *  @param ctx Pointer to the array of worker contexts.
+ *  @param workers Number of workers.
+ */
+static void run_workers(dns_ctx_t *ctx, int workers)
+{
+#ifdef WITH_THREADS
+   int i, e;
+
+   if (workers > 1)
+   {
+      for (i = 0; i < workers; i++)
+         if ((e = pthread_create(&ctx[i].thread, NULL, worker_main, &ctx[i])))
+         {
+            log_msg(LOG_EMERG, "could not create worker thread: %s", strerror(e));
+            exit(EXIT_FAILURE);
+         }
+
+      for (i = 0; i < workers; i++)
+         (void) pthread_join(ctx[i].thread, NULL);
+      return;
+   }
+#else
+   (void) workers;
+#endif
+   (void) dispatch_packets(ctx);
+}
+
+
+//#define TEST_UTDNS_FUNC
+#ifdef TEST_UTDNS_FUNC
+void test_utdns_func(void)
+{
+   // a name, a compressed name, and a compression loop behind the header
+   char testar[] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+      3, 'a', 'b', 'c', 3, 'd', 'e', 'f', 0,
+      3, 'x', 'y', 'z', 0xc0, 12,
+      0xc0, 27};
+   char buf[DNS_NAME_SIZE];
+   int off[] = {12, 21, 27}, i, n;
+
+   for (i = 0; i < 3; i++)
+   {
+      n = dns_name_str(testar, sizeof(testar), off[i], buf, sizeof(buf));
+      printf("%d: %d '%s'\n", off[i], n, n == -1 ? "" : buf);
+   }
+   dns_hash_bench();
+   exit(0);
+}
+#endif
+
+
+static void background(void)
+{
+   pid_t pid, ppid;
+
+   log_msg(LOG_DEBUG, "backgrounding");
+
+   ppid = getpid();
+   pid = fork();
+   switch(pid)
+   {
+      case -1:
+         log_msg(LOG_ERR, "fork failed: %s. Staying in foreground", strerror(errno));
+         return;
 
       case 0:
          log_msg(LOG_INFO, "process backgrounded by parent %d, new pid = %d", ppid, getpid());
@@ -681,26 +3379,122 @@ static void drop_privileges(void)
 }
 
 
+/*! Parse an upstream NS of the command line. It is an IPv4 or IPv6 address
+ *  or a hostname which is resolved once, optionally followed by a port. The
+ *  addresses are ordered alternating between the address families beginning
+ *  with the family of the first address returned by getaddrinfo() (RFC 8305).
+ *  @param up Pointer to the upstream.
+ *  @param arg Argument of the command line.
+ *  @param port Default port.
+ *  @return Returns 0 on success or -1 in case of error.
+ */
+static int parse_upstream(upstream_t *up, const char *arg, int port)
+{
+   struct addrinfo hints, *res, *ai;
+   sock_addr_t addr[UP_MAX_ADDR];
+   char host[256], sport[8], *p;
+   int i, k, n, e, fam, used[UP_MAX_ADDR];
+
+   up->name = arg;
+   snprintf(host, sizeof(host), "%s", arg);
+   if (*host == '[')
+   {
+      if ((p = strchr(host, ']')) == NULL || (p[1] != '\0' && p[1] != ':'))
+      {
+         log_msg(LOG_ERR, "invalid NS address %s", arg);
+         return -1;
+      }
+      *p++ = '\0';
+      memmove(host, host + 1, strlen(host));
+      if (*p == ':')
+         port = atoi(p + 1);
+   }
+   // more than one colon is an IPv6 address without port
+   else if ((p = strchr(host, ':')) != NULL && strchr(p + 1, ':') == NULL)
+   {
+      *p = '\0';
+      port = atoi(p + 1);
+   }
+
+   if (port < 1 || port > 65535)
+   {
+      log_msg(LOG_ERR, "invalid port of NS %s", arg);
+      return -1;
+   }
+   snprintf(sport, sizeof(sport), "%d", port);
+
+   memset(&hints, 0, sizeof(hints));
+   hints.ai_family = AF_UNSPEC;
+   hints.ai_socktype = SOCK_STREAM;
+   hints.ai_flags = AI_NUMERICSERV;
+   if ((e = getaddrinfo(host, sport, &hints, &res)))
+   {
+      log_msg(LOG_ERR, "could not resolve NS %s: %s", host, gai_strerror(e));
+      return -1;
+   }
+   for (n = 0, ai = res; ai != NULL && n < UP_MAX_ADDR; ai = ai->ai_next)
+      if ((ai->ai_family == AF_INET || ai->ai_family == AF_INET6) && ai->ai_addrlen <= sizeof(*addr))
+      {
+         memcpy(&addr[n], ai->ai_addr, ai->ai_addrlen);
+         used[n++] = 0;
+      }
+   freeaddrinfo(res);
+
+   if (!n || (up->addr = malloc(n * sizeof(*up->addr))) == NULL)
+   {
+      log_msg(LOG_ERR, "no address of NS %s", arg);
+      return -1;
+   }
+
+   for (i = 0, fam = addr[0].sa.sa_family; i < n; i++, fam = fam == AF_INET ? AF_INET6 : AF_INET)
+   {
+      for (k = 0; k < n && (used[k] || addr[k].sa.sa_family != fam); k++);
+      // no address of this family left
+      if (k == n)
+         for (k = 0; used[k]; k++);
+      used[k] = 1;
+      up->addr[i] = addr[k];
+   }
+   up->addr_cnt = n;
+   up->pref = 0;
+   return 0;
+}
+
+
 static void usage(const char *argv0)
 {
    printf(
          "UDP/DNS-to-TCP/DNS-Translator %s, Bernhard R. Fischer, 4096R/8E24F29D <bf@abenteuerland.at>.\n"
-         "Usage: %s [OPTIONS] <NS ip>\n"
+         "Usage: %s [OPTIONS] <NS> [<NS> ...]\n"
          "   -4 .......... Bind to IPv4 only instead of IP + IPv6.\n"
          "   -b .......... Background process and log to syslog.\n"
+         "   -B <n> ...... Number of datagrams received/sent per system call (default %d).\n"
+         "   -c <n> ...... Maximum number of TCP sessions to each NS (default %d).\n"
+         "   -C <n> ...... Number of entries of the response cache, 0 disables it (default %d).\n"
          "   -d .......... Set log level to LOG_DEBUG.\n"
-         "   -p <port> ... Set incoming UDP port number.\n"
-         "   -P <port> ... Set destination port number.\n",
-         PACKAGE_VERSION, argv0);
+         "   -H <n> ...... Budget of hedged queries in percent, 0 disables hedging (default %d).\n"
+         "   -m <n> ...... Minimum number of TCP sessions kept open to each NS (default %d).\n"
+         "   -n <n> ...... Maximum number of concurrent transactions per worker (default %d).\n"
+         "   -p <port> ... Set incoming UDP and TCP port number.\n"
+         "   -P <port> ... Set default destination port number.\n"
+         "   -q .......... Set log level to LOG_NOTICE, queries are not logged.\n"
+         "   -t <s> ...... Timeout of transactions in seconds (default %d).\n"
+         "   -T <path> ... Write a dnstap log to a file or to \"unix:<socket>\".\n"
+         "   -w <n> ...... Number of worker threads (default 1).\n"
+         "NS is an IPv4 or IPv6 address or a hostname, optionally followed by a port:\n"
+         "   <addr>, <name>, <IPv4>:<port>, <name>:<port>, [<IPv6>]:<port>\n"
+         "Send SIGUSR1 to log statistics.\n",
+         PACKAGE_VERSION, argv0, UDP_BATCH, MAX_NS_CONN, CACHE_SIZE, HEDGE_BUDGET, MIN_NS_CONN, MAX_TRX, TIMEOUT);
 }
 
 
 int main(int argc, char **argv)
 {
-   struct sockaddr_in in;
-   dns_trx_t *trx;
-   int udp_sock, tcp_sock, udp_port = 53, family = AF_INET6;
+   struct sigaction sa;
+   dns_ctx_t tmpl, *ctx;
+   int i, udp_port = 53, family = AF_INET6, workers = 1;
    int c, bground = 0, debuglevel = LOG_INFO;
+   char *tap_path = NULL;
 
 #ifdef TEST_UTDNS_FUNC
    test_utdns_func();
@@ -710,8 +3504,18 @@ int main(int argc, char **argv)
    (void) init_log("stderr", debuglevel);
 #endif
 
+   srandom(time(NULL) ^ getpid());
+   memset(&tmpl, 0, sizeof(tmpl));
+   tmpl.ns_cnt = MAX_NS_CONN;
+   tmpl.batch = UDP_BATCH;
+   tmpl.cache_size = CACHE_SIZE;
+   tmpl.max_trx = MAX_TRX;
+   tmpl.timeout = TIMEOUT;
+   tmpl.hedge_pct = HEDGE_BUDGET;
+   tmpl.min_conn = MIN_NS_CONN;
+
    int dst_port = 53;
-   while ((c = getopt(argc, argv, "4bdhp:P:")) != -1)
+   while ((c = getopt(argc, argv, "4bB:c:C:dhH:m:n:p:P:qt:T:w:")) != -1)
    {
       switch (c)
       {
@@ -723,6 +3527,24 @@ int main(int argc, char **argv)
             bground++;
             break;
 
+         case 'B':
+            tmpl.batch = atoi(optarg);
+            if (tmpl.batch < 1)
+               tmpl.batch = 1;
+            else if (tmpl.batch > MAX_UDP_BATCH)
+               tmpl.batch = MAX_UDP_BATCH;
+            break;
+
+         case 'c':
+            if ((tmpl.ns_cnt = atoi(optarg)) < 1)
+               tmpl.ns_cnt = 1;
+            break;
+
+         case 'C':
+            if ((tmpl.cache_size = atoi(optarg)) < 0)
+               tmpl.cache_size = 0;
+            break;
+
          case 'd':
             debuglevel = LOG_DEBUG;
             break;
@@ -731,6 +3553,27 @@ int main(int argc, char **argv)
             usage(argv[0]);
             exit(EXIT_SUCCESS);
 
+         case 'H':
+            tmpl.hedge_pct = atoi(optarg);
+            if (tmpl.hedge_pct < 0)
+               tmpl.hedge_pct = 0;
+            else if (tmpl.hedge_pct > 100)
+               tmpl.hedge_pct = 100;
+            break;
+
+         case 'm':
+            if ((tmpl.min_conn = atoi(optarg)) < 0)
+               tmpl.min_conn = 0;
+            break;
+
+         case 'n':
+            tmpl.max_trx = atoi(optarg);
+            if (tmpl.max_trx < 1)
+               tmpl.max_trx = 1;
+            else if (tmpl.max_trx > MAX_TRX_LIMIT)
+               tmpl.max_trx = MAX_TRX_LIMIT;
+            break;
+
          case 'p':
             udp_port = atoi(optarg);
             break;
@@ -738,6 +3581,34 @@ int main(int argc, char **argv)
 	 case 'P':
 	    dst_port = atoi(optarg);
 	    break;
+
+         case 'q':
+            debuglevel = LOG_NOTICE;
+            break;
+
+         case 't':
+            if ((tmpl.timeout = atoi(optarg)) < 1)
+               tmpl.timeout = 1;
+            break;
+
+         case 'T':
+            tap_path = optarg;
+            break;
+
+         case 'w':
+            workers = atoi(optarg);
+            if (workers < 1)
+               workers = 1;
+            else if (workers > MAX_WORKERS)
+               workers = MAX_WORKERS;
+#ifndef WITH_THREADS
+            if (workers > 1)
+            {
+               log_msg(LOG_WARN, "compiled without thread support, running 1 worker");
+               workers = 1;
+            }
+#endif
+            break;
       }
    }
 
@@ -747,20 +3618,36 @@ int main(int argc, char **argv)
       exit(EXIT_FAILURE);
    }
 
-   memset(&in, 0, sizeof(in));
-   in.sin_family = AF_INET;
-   in.sin_port = htons(dst_port);
-   if (!inet_aton(argv[optind], &in.sin_addr))
+   if (tmpl.min_conn > tmpl.ns_cnt)
+      tmpl.min_conn = tmpl.ns_cnt;
+
+   // every worker copies the upstreams in init_ctx()
+   tmpl.up_cnt = argc - optind;
+   if ((tmpl.up = calloc(tmpl.up_cnt, sizeof(*tmpl.up))) == NULL)
+      perror("calloc"), exit(EXIT_FAILURE);
+   for (i = 0; i < tmpl.up_cnt; i++)
+      if (parse_upstream(&tmpl.up[i], argv[optind + i], dst_port) == -1)
+         exit(EXIT_FAILURE);
+
+   if ((ctx = calloc(workers, sizeof(*ctx))) == NULL)
+      perror("calloc"), exit(EXIT_FAILURE);
+
+   // every worker binds its own sockets, the kernel shards the traffic
+   for (i = 0; i < workers; i++)
    {
-      log_msg(LOG_ERR, "could not convert %s to in_addr\n", argv[optind]);
-      exit(EXIT_FAILURE);
-   }
+      ctx[i] = tmpl;
+      ctx[i].id = workers > 1 ? i + 1 : 0;
+
+      if ((ctx[i].udp_sock = init_udp_socket(family, udp_port, workers > 1)) == -1)
+         perror("init_udp_socket"), exit(EXIT_FAILURE);
 
-   if ((udp_sock = init_udp_socket(family, udp_port)) == -1)
-      perror("init_udp_socket"), exit(EXIT_FAILURE);
+      if ((ctx[i].tcp_sock = init_tcp_socket(family, udp_port, workers > 1)) == -1)
+         perror("init_tcp_socket"), exit(EXIT_FAILURE);
+   }
 
-   if ((tcp_sock = init_tcp_socket(family, udp_port)) == -1)
-      perror("init_tcp_socket"), exit(EXIT_FAILURE);
+   // the output is opened with the privileges of the caller
+   if (tap_path != NULL && dnstap_open(tap_path) == -1)
+      exit(EXIT_FAILURE);
 
    drop_privileges();
 
@@ -772,17 +3659,34 @@ int main(int argc, char **argv)
    else
       (void) init_log("stderr", debuglevel);
 
-   if ((trx = calloc(MAX_TRX, sizeof(*trx))) == NULL)
+   // the writer thread has to be started after fork()
+   (void) log_start();
+   if (dnstap_start() == -1)
+      exit(EXIT_FAILURE);
+   log_msg(LOG_DEBUG, "using %s name hashing", dns_hash_init());
+
+   for (i = 0; i < workers; i++)
+      if (init_ctx(&ctx[i]) == -1)
+         exit(EXIT_FAILURE);
+
+   memset(&sa, 0, sizeof(sa));
+   sa.sa_handler = sig_handler;
+   if (sigaction(SIGUSR1, &sa, NULL) == -1)
+      log_msg(LOG_ERR, "sigaction() failed: %s", strerror(errno));
+
+   run_workers(ctx, workers);
+
+   for (i = 0; i < workers; i++)
    {
-      perror("calloc");
-      (void) close(udp_sock);
-      return -1;
+      log_stats(&ctx[i]);
+      free_ctx(&ctx[i]);
    }
-
-   dispatch_packets(udp_sock, tcp_sock, trx, MAX_TRX, (struct sockaddr*) &in, sizeof(in));
-   free(trx);
-   close(tcp_sock);
-   close(udp_sock);
+   free(ctx);
+   for (i = 0; i < tmpl.up_cnt; i++)
+      free(tmpl.up[i].addr);
+   free(tmpl.up);
+   dnstap_close();
+   log_stop();
 
    return 0;
 }
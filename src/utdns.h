@@ -0,0 +1,280 @@
+/* Copyright 2013-2024 Bernhard R. Fischer, 4096R/8E24F29D <bf@abenteuerland.at>
+ *
+ * This file is part of Utdns.
+ *
+ * Utdns is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * Utdns is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Utdns. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*! \file utdns.h
+ *  \author Bernhard R. Fischer, <bf@abenteuerland.at>
+ *
+ *  This file contains the declarations which are shared between the source
+ *  files of Utdns.
+ */
+#ifndef UTDNS_H
+#define UTDNS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <syslog.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+
+
+#define LOG_WARN LOG_WARNING
+
+// number of message IDs of DNS
+#define IDMAP_SIZE 65536
+// maximum number of worker threads
+#define MAX_WORKERS 64
+
+// maximum size of a DNS message on TCP
+#define FRAMESIZE 65536
+// number of size classes of the buffer pool
+#define POOL_CLASSES 3
+// maximum number of bytes of unused buffers kept per size class
+#define POOL_MAX_FREE (4 * 1024 * 1024)
+
+// default number of entries of the response cache
+#define CACHE_SIZE 4096
+// maximum length of a cache key (question plus flags)
+#define CACHE_KEY_SIZE 264
+// maximum number of RRs of a cached answer
+#define CACHE_MAX_RR 256
+// maximum lifetime [s] of a cached answer
+#define CACHE_MAX_TTL 86400
+// maximum size of a cached answer
+#define CACHE_MAX_MSG 4096
+
+// number of levels and slots per level of the timer wheel
+#define TW_LEVELS 4
+#define TW_SLOTS 64
+
+// length of the header of a DNS message
+#define DNS_HDR_LEN 12
+// size of a buffer which keeps every domain name in dotted notation
+#define DNS_NAME_SIZE 256
+// RR type of EDNS0 pseudo RR
+#define RR_TYPE_OPT 41
+
+// flags of a query which are part of the cache key
+#define CACHE_FLAG_EDNS 0x01
+#define CACHE_FLAG_DO 0x02
+#define CACHE_FLAG_CD 0x04
+
+
+// sections of a DNS message
+enum {DNS_SEC_QD, DNS_SEC_AN, DNS_SEC_NS, DNS_SEC_AR, DNS_SECTIONS};
+
+//! message types of the dnstap log
+enum {DNSTAP_CLIENT_QUERY = 5, DNSTAP_CLIENT_RESPONSE = 6, DNSTAP_FORWARDER_QUERY = 7, DNSTAP_FORWARDER_RESPONSE = 8};
+
+/*! Position of a record (or question) within a DNS message. All offsets are
+ * relative to the beginning of the message.
+ */
+typedef struct dns_rr
+{
+   int section;                     // section of the record (DNS_SEC_xxx)
+   int off;                         // offset of the owner name
+   int len;                         // total length of the record
+   int type;                        // RR type
+   int class;                       // RR class
+   int ttl_off;                     // offset of the TTL, -1 for questions
+   int rdata;                       // offset of the RDATA
+   int rdlen;                       // length of the RDATA
+} dns_rr_t;
+
+/*! Iterator over the records of a DNS message. */
+typedef struct dns_msg
+{
+   const char *msg;                 // DNS message
+   int len;                         // length of the message
+   int cnt[DNS_SECTIONS];           // number of records per section
+   int sec;                         // current section
+   int idx;                         // index of the next record within sec
+   int off;                         // offset of the next record
+} dns_msg_t;
+
+/*! Results of parsing a query. */
+typedef struct dns_query
+{
+   int qdcount;                     // number of questions
+   int qlen;                        // length of the first question, -1 if none
+   int qtype;                       // type of the first question
+   int qclass;                      // class of the first question
+   dns_rr_t opt;                    // OPT RR, opt.off is -1 if there is none
+} dns_query_t;
+
+
+/*! An idmap hands out unique 16 bit DNS message IDs and maps them back to an
+ * object in constant time. Free IDs are kept in a FIFO ring thus a released
+ * ID is reused as late as possible.
+ */
+typedef struct idmap
+{
+   void **slot;                     // objects indexed by ID
+   uint16_t *ring;                  // ring of free IDs
+   uint16_t head;                   // index of first free ID in ring
+   unsigned cnt;                    // number of free IDs in ring
+} idmap_t;
+
+
+/*! A pool of message buffers in a few size classes. Unused buffers are kept
+ * on a free stack per class.
+ */
+typedef struct buf_pool
+{
+   void *free[POOL_CLASSES];        // stacks of unused buffers
+   int free_cnt[POOL_CLASSES];      // number of unused buffers
+   int used_cnt[POOL_CLASSES];      // number of buffers in use
+} buf_pool_t;
+
+
+/*! A timer of the timer wheel. Timers are kept in doubly linked lists, one
+ * per slot of the wheel.
+ */
+typedef struct wtimer
+{
+   struct wtimer *next;             // next timer in slot
+   struct wtimer **pprev;           // pointer to this, NULL if not pending
+   uint64_t expire;                 // expiry [ticks]
+   int slot;                        // slot of the wheel the timer is linked to
+   void (*func)(void *, void *);    // callback, called with p of wheel and data
+   void *data;                      // argument of callback
+} wtimer_t;
+
+/*! A hierarchical timer wheel. */
+typedef struct twheel
+{
+   wtimer_t *slot[TW_LEVELS][TW_SLOTS];
+   uint64_t bits[TW_LEVELS];        // bitmap of non-empty slots per level
+   uint64_t now;                    // current time [ticks]
+   int cnt;                         // number of pending timers
+   void *p;                         // first argument of callbacks
+} twheel_t;
+
+
+typedef struct cache_entry cache_entry_t;
+
+/*! The response cache is a hash table with a fixed maximum number of
+ * entries. All entries are additionally kept in an LRU list.
+ */
+typedef struct dns_cache
+{
+   cache_entry_t **bucket;          // hash buckets
+   unsigned mask;                   // number of buckets - 1
+   int size;                        // maximum number of entries, 0 = disabled
+   int cnt;                         // current number of entries
+   cache_entry_t *lru_head, *lru_tail;
+   unsigned long hits;              // number of cache hits
+   unsigned long misses;            // number of cache misses
+   unsigned long inserts;           // number of answers inserted
+} dns_cache_t;
+
+
+//! lock-free ring of fixed-size records, single producer and single consumer
+typedef struct spsc
+{
+   char *buf;                       // records
+   unsigned mask;                   // number of records - 1
+   unsigned rec_size;               // size of a record
+   // the counters are written by different threads, keep them apart
+   unsigned head __attribute__((aligned(64)));  // next record to consume
+   unsigned tail __attribute__((aligned(64)));  // next record to produce
+} spsc_t;
+
+
+/* smlog.c */
+void log_msg(int, const char*, ...) __attribute__((format (printf, 2, 3)));
+FILE *init_log(const char*, int);
+int log_enabled(int);
+int log_start(void);
+void log_stop(void);
+unsigned long log_dropped(void);
+
+/* utdns.c */
+int sm_thread_id(void);
+
+/* clock.c */
+uint64_t clock_update(void);
+uint64_t clock_ms(void);
+void clock_wall(struct timeval *);
+
+/* idmap.c */
+int idmap_init(idmap_t *);
+void idmap_free(idmap_t *);
+int idmap_get(idmap_t *, void *);
+void *idmap_lookup(const idmap_t *, int);
+void idmap_put(idmap_t *, int);
+
+/* bufpool.c */
+void pool_init(buf_pool_t *);
+void pool_free(buf_pool_t *);
+char *pool_get(buf_pool_t *, int, int *);
+void pool_put(buf_pool_t *, char *, int);
+
+/* timer.c */
+void tw_init(twheel_t *, uint64_t, void *);
+void tw_add(twheel_t *, wtimer_t *, uint64_t);
+void tw_del(twheel_t *, wtimer_t *);
+int64_t tw_next(const twheel_t *);
+void tw_advance(twheel_t *, uint64_t);
+
+/* cache.c */
+int cache_init(dns_cache_t *, int);
+void cache_free(dns_cache_t *);
+int cache_qflags(const char *, const dns_query_t *);
+int cache_qhash(const char *, int, int, uint32_t *);
+int cache_qcmp(const char *, const char *, int);
+int cache_copy_answer(char *, int, int, const char *, int);
+int cache_lookup(dns_cache_t *, char *, int, int, int, time_t);
+int cache_insert(dns_cache_t *, const char *, int, int, time_t);
+
+/* dnsmsg.c */
+int dns_name_end(const char *, int, int);
+int dns_name_str(const char *, int, int, char *, int);
+int dns_msg_init(dns_msg_t *, const char *, int);
+int dns_msg_next(dns_msg_t *, dns_rr_t *);
+int dns_query_parse(const char *, int, dns_query_t *);
+
+/* spsc.c */
+int spsc_init(spsc_t *, unsigned, unsigned);
+void spsc_free(spsc_t *);
+void *spsc_reserve(spsc_t *);
+void spsc_commit(spsc_t *);
+void *spsc_peek(spsc_t *);
+void spsc_release(spsc_t *);
+
+/* dnstap.c */
+int dnstap_open(const char *);
+int dnstap_start(void);
+void dnstap_close(void);
+spsc_t *dnstap_ring(void);
+void dnstap_log(spsc_t *, int, int, const struct sockaddr *, const struct timeval *, const struct timeval *, const char *, int);
+void dnstap_stats(unsigned long *, unsigned long *);
+
+/* dnshash.c */
+const char *dns_hash_init(void);
+uint32_t dns_lower_hash(char *, const char *, int);
+#ifdef TEST_UTDNS_FUNC
+void dns_hash_bench(void);
+#endif
+
+/* edns.c */
+int edns_keepalive(const char *, const dns_rr_t *);
+int edns_set_keepalive(char *, int, int, int);
+int edns_get_keepalive(const char *, int);
+
+#endif
+